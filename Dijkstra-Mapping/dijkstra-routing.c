@@ -1,11 +1,53 @@
 /* Mackenzie Bowal
-This program initializes a graph and list of cities according to the "canadamap.txt" input file,
-and executes Dijkstra's Algorithm on it, using YYC as the source node. 
-The original graph, with edge weights represented by an adjacency matrix, the list of cities,
-the paths found by the algorithm, and the minimum distance between YYC and every city are printed
-to the console.
+This program reads a road map (a text map such as "canadamap.txt", standard input, or a compiled graph) and
+executes Dijkstra's Algorithm on it, using the map's first city as the source. The graph as a V x V matrix of
+road lengths, the list of cities, the path found to every city and its minimum distance from the source are
+printed to the console, all in the order the map lists the cities; "dijkstra-routing -q" leaves out the matrix.
+
+The input is a list of "<city> <city> <distance>" lines read until the end of the file; the number of cities and
+edges is whatever the file holds, and the first city read is the source. The next city to settle is taken from
+a binary heap with decrease-key, so the search takes O((V+E) log V) heap work. The graph is kept in compressed
+sparse row form: each city's edges are one run of the neighbour and weight arrays, so only real edges are stored
+and relaxing a city reads its edges sequentially. Each path is read off the parent array in one walk back from
+its city, and the output is gathered into large writes.
+
+The map file is memory-mapped and parsed in place, with city names interned through a hash table. Running
+"dijkstra-routing compile <map.txt> <map.graph>" writes the graph in a binary form that is memory-mapped as it is
+by later runs ("dijkstra-routing <map.graph>"), so a large map loads without any parsing. With no file named the
+map is read from standard input.
+
+"dijkstra-routing serve <map>" loads the graph once and answers "route SRC DST" and "tree SRC" queries over TCP
+(port ROUTEPORT) or a Unix-domain socket, one line per query. Each worker thread keeps its search arrays between
+queries and starts a new search by bumping a generation counter instead of clearing them, and the trees of hot
+sources are kept in an LRU cache. Compile with -pthread.
+
+Other routes are found with A* over ALT lower bounds: a compiled map stores every city's distance to a few
+landmarks spread around its edges, and the difference of two cities' distances to a landmark bounds the route
+between them from below. "dijkstra-routing compile -c" also builds a contraction hierarchy: cities are
+contracted one round of non-adjacent cities at a time, in parallel, with shortcut edges added to keep distances
+between the rest, and a route query then only climbs the hierarchy from both ends before its shortcuts are
+unpacked. Such maps answer routes from the hierarchy. "dijkstra-routing route <map> SRC DST
+[dijkstra|bidir|alt|ch]" runs one query with the named search and reports how many cities it settled.
+
+"dijkstra-routing batch <map>" writes a matrix of the distances from every city (or from the cities listed in a
+file given with -s) to every city, as CSV or, with -b, binary. Each thread runs whole searches from the next
+source with its own search arrays, and the rows are written in source order. "dijkstra-routing sssp <map>" finds
+one shortest-path tree with delta-stepping instead, settling a bucket of distances at a time with the
+relaxations spread over threads, and with -v checks it against Dijkstra's Algorithm.
+
+Roads can be changed on a loaded graph: "set SRC DST LENGTH" and "close SRC DST" lines sent to the server (or
+read by "dijkstra-routing update <map> <changes>") change the graph and repair the cached trees in place. A
+shorter road spreads its improvement outwards; a longer one, if it is a tree edge, re-settles only the subtree
+below it.
+
+Cities are numbered in the order the map lists them, which says nothing about where they are, so a search's
+relaxations jump all over the arrays. "dijkstra-routing compile -r" renumbers them in reverse Cuthill-McKee order
+first (the maps have no coordinates for a space-filling curve) and stores where each city went, so every command
+still takes and prints cities in the order of the map. "dijkstra-routing bench <map>" times searches and routes
+on a map, with their cache misses where the kernel lets them be counted.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,217 +55,3464 @@ to the console.
 #include <sys/types.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define NOROAD 9999         // filler for cities with no road between them, only in the matrix dump
+#define WRITEBUF 65536      // bytes of output gathered before each write
+
+// Compiled graph files
+#define GRAPHMAGIC "DJGRAPH"
+#define GRAPHVERSION 4
+#define MAXSECTIONS 16
+#define NUMLANDMARKS 8      // landmarks chosen when a map is compiled
+#define MAXLANDMARKS 64
+
+// Sections of a compiled graph file
+#define OFFSETS 0
+#define TARGETS 1
+#define WEIGHTS 2
+#define NAMEOFFSETS 3
+#define NAMES 4
+#define LANDMARKS 5
+#define LANDMARKDIST 6
+#define RANKS 7
+#define UPOFFSETS 8
+#define UPTARGETS 9
+#define UPWEIGHTS 10
+#define UPMIDDLES 11
+#define PLACES 12
+#define NUMSECTIONS 13
+
+// Contraction hierarchy preprocessing
+#define WITNESSLIMIT 500    // vertices a witness search settles before giving up and adding the shortcut
+#define ESTIMATELIMIT 50    // the same when only counting shortcuts for a priority
+#define WORKCHUNK 64        // vertices a preprocessing thread takes at a time
+#define MAXTHREADS 64
+#define REMAINING 0         // states of a vertex during contraction
+#define INROUND 1
+#define CONTRACTED 2
+#define ORDERING 0          // preprocessing phases run on every thread
+#define SELECTING 1
+#define CONTRACTING 2
+
+// Point-to-point searches
+#define ONEWAY 0            // Dijkstra's Algorithm from the source until the target is settled
+#define BIDIRECTIONAL 1     // Dijkstra's Algorithm from both ends at once
+#define ALT 2               // A* with lower bounds from landmark distances
+#define HIERARCHY 3         // upward bidirectional search of a contraction hierarchy
+
+// Route query server
+#define ROUTEPORT 9300
+#define MAXWORKERS 64
+#define LINELEN 256         // longest query line
+#define TREECACHE 8         // shortest-path trees kept for hot sources
+#define HOTAFTER 3          // route queries from one source before its whole tree is computed and cached
+#define HOTSLOTS 4096       // sources whose route queries are counted, a power of two
+
+// Batch distance matrices
+#define MATRIXMAGIC "DJMATRX"
+#define CSV 0
+#define BINARY 1
+
+// Benchmark
+#define BENCHROUTES 1000    // route queries timed, unless -n says otherwise
+#define BENCHSEARCHES 10    // whole searches timed, unless -s says otherwise
+
+// Graph in compressed sparse row form: the edges of vertex u are targets[offsets[u]] .. targets[offsets[u+1]-1]
+struct graph {
+    int numNodes;
+    int ownsArcs;           // offsets, targets and weights were allocated rather than mapped from a file
+    uint32_t numArcs;       // each road is stored once in each direction
+    uint32_t arcCap;        // room allocated in targets and weights
+    uint32_t *offsets;      // numNodes + 1 entries
+    uint32_t *targets;
+    int32_t *weights;
+    uint32_t nameBytes;
+    uint32_t *nameOffsets;  // where each city's NUL-terminated name starts in names
+    char *names;
+    int numLandmarks;
+    uint32_t *landmarks;
+    int32_t *landmarkDist;  // distance between v and landmark l at [v * numLandmarks + l], INT_MAX if unreachable
+    uint32_t *ranks;        // contraction order of each vertex, NULL without a hierarchy
+    uint32_t numUpArcs;
+    uint32_t *upOffsets;    // hierarchy arcs from each vertex to higher-ranked ones, in CSR form
+    uint32_t *upTargets;
+    int32_t *upWeights;
+    int32_t *upMiddles;     // the vertex a shortcut bypasses, -1 for a road
+    uint32_t *places;       // vertex of each city by its position in the map, NULL unless the graph was reordered
+    uint32_t *positions;    // position in the map of each vertex, the inverse of places
+};
+
+// Start of a compiled graph file; each section is an array at a multiple of 8 bytes into the file
+struct graph_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t numNodes;
+    uint32_t numArcs;
+    uint32_t nameBytes;
+    uint32_t numLandmarks;
+    uint32_t numUpArcs;
+    uint64_t sections[MAXSECTIONS][2];  // offset and length in bytes, 0 for an absent section
+};
+
+// Reusable state of one shortest-path search. A vertex's distance, parent and heap position are only valid while
+// its stamp equals the current generation, so a new search starts without clearing anything.
+struct search {
+    uint32_t gen;
+    uint32_t *stamp;
+    int *dist;
+    int *parent;
+    int *prio;              // heap key in an A* search: the distance plus a lower bound on the rest of the way
+    long settled;
+    struct heap *heap;
+};
+
+// A read-only view of a search result or of a cached tree (stamp NULL: every entry is valid)
+struct tree_view {
+    int *dist;
+    int *parent;
+    uint32_t *stamp;
+    uint32_t gen;
+};
+
+// A shortest-path tree kept for a hot source
+struct tree {
+    int source;             // -1 while free or being filled
+    int refs;               // queries using it; it is only replaced while 0
+    long lastUsed;
+    int *dist;
+    int *parent;
+};
+
+// Trees of hot sources shared by all server workers, least recently used replaced first
+struct tree_cache {
+    pthread_mutex_t lock;
+    long clock;
+    struct tree trees[TREECACHE];
+    int hotSource[HOTSLOTS];    // route queries counted per source, one source per slot
+    int hotCount[HOTSLOTS];
+};
+
+// A server worker with its own search state
+struct worker {
+    pthread_t thread;
+    struct search search;
+    struct search back;     // the search from the target in a bidirectional query
+    int *pathNodes;         // room for the longest path
+    int *hops;              // a hierarchy route before its shortcuts are unpacked
+    struct pollfd *listeners;
+};
+
+// A reply being built up before it is sent
+struct reply {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+// Output gathered into large writes, for results too big to build up whole
+struct writer {
+    int fd;
+    size_t used;
+    char buf[WRITEBUF];
+};
+
+// An edge of a vertex during contraction
+struct ch_arc {
+    uint32_t target;
+    int32_t weight;
+    int32_t middle;         // the contracted vertex a shortcut bypasses, -1 for a road
+};
+
+// The edges of a vertex during contraction. Once it is contracted they are left as they were, and they are its
+// arcs to the higher-ranked vertices.
+struct ch_node {
+    int degree;
+    int cap;
+    struct ch_arc *arcs;
+};
+
+// Contraction hierarchy preprocessing state shared by the preprocessing threads
+struct contraction {
+    struct graph *g;
+    struct ch_node *nodes;
+    uint8_t *state;         // REMAINING, INROUND or CONTRACTED
+    uint8_t *selected;      // chosen for the current round
+    int *priority;          // edge difference plus contracted neighbours, lowest contracted first
+    int *deleted;           // contracted neighbours
+    int phase;
+    int *work;              // the vertices the current phase works through
+    int workSize;
+    int next;               // the next of them to be taken by a thread
+};
+
+// A preprocessing thread with its own witness search and the shortcuts it has found this round
+struct contractor {
+    pthread_t thread;
+    struct contraction *c;
+    struct search search;
+    uint32_t *target;       // equal to the search's generation for the vertices a witness search looks for
+    int (*found)[4];        // u, w, length and bypassed vertex
+    int numFound;
+    int foundCap;
+};
+
+// A batch of single-source searches whose distance rows are written out in source order
+struct batch {
+    int *sources;
+    int numSources;
+    int next;               // the next source to be taken by a thread
+    int written;            // rows written so far
+    int format;             // CSV or BINARY
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t turn;    // signalled whenever a row has been written
+};
+
+// A batch thread with its own search state and row buffer
+struct batch_worker {
+    pthread_t thread;
+    struct batch *b;
+    struct search search;
+    struct reply row;
+};
+
+// Start of a binary distance matrix, followed by the source indices (uint32) and then one row of int32 distances
+// (-1 for unreachable) per source
+struct matrix_header {
+    char magic[8];
+    uint32_t numSources;
+    uint32_t numNodes;
+};
+
+// Delta-stepping single-source search shared by its threads. A vertex's distance and parent are packed into one
+// word, distance high, so both are lowered together by one compare-and-swap and ties go to the lower parent.
+struct delta_stepping {
+    struct graph *g;
+    uint64_t *best;
+    int delta;
+    int numThreads;
+    int numBuckets;         // bucket lists are used cyclically: no edge reaches further ahead than this
+    long bucket;            // index of the bucket being settled
+    int done;
+    int *frontier;          // the vertices of the current bucket still to relax
+    int frontierSize;
+    int next;               // the next of them to be taken by a thread
+    uint32_t *queued;       // equal to gatherGen once a vertex is in the frontier
+    uint32_t gatherGen;
+    pthread_barrier_t barrier;
+    struct delta_thread *threads;
+};
 
-#define INF 9999
-#define V 21
+// A delta-stepping thread with its own bucket lists, so relaxations need no lock
+struct delta_thread {
+    pthread_t thread;
+    struct delta_stepping *d;
+    int id;
+    int **buckets;          // vertices put in each bucket by this thread, bucket i at [i % numBuckets]
+    int *sizes;
+    int *caps;
+    int *settled;           // vertices this thread relaxed from the current bucket, for its heavy edges
+    int numSettled;
+    int settledCap;
+};
 
-/* nextNode()
-Takes the current distances of nodes reachable by the algorithm and the list of nodes 
-currently reachable and returns the node that has not yet been reached which has the 
-smallest distance from the source node.
+// Open-addressing hash table from city name to index, used while parsing
+struct name_table {
+    uint32_t mask;          // capacity - 1, the capacity being a power of two
+    uint32_t *slots;        // city index + 1, or 0 for an empty slot
+};
+
+// Binary min-heap of vertices keyed by their distance, with each vertex's position so its key can be lowered
+struct heap {
+    int size;
+    int *nodes;             // heap order
+    int *pos;               // position of each vertex in nodes, -1 if not in the heap
+    int *keys;              // the distances (or A* priorities) the heap is ordered by
+};
+
+/* heapSwap()
+Swaps two heap positions and records the vertices' new positions.
+*/
+
+void heapSwap(struct heap *h, int i, int j) {
+    int a = h->nodes[i];
+    int b = h->nodes[j];
+    h->nodes[i] = b;
+    h->nodes[j] = a;
+    h->pos[b] = i;
+    h->pos[a] = j;
+}
+
+/* siftUp()
+Moves the vertex at heap position i up until its parent's distance is no larger.
+*/
+
+void siftUp(struct heap *h, int i) {
+    while (i > 0 && h->keys[h->nodes[(i - 1) / 2]] > h->keys[h->nodes[i]]) {
+        heapSwap(h, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/* siftDown()
+Moves the vertex at heap position i down until neither child has a smaller distance.
 */
 
-int nextNode(int distances[V], bool inPath[V]) {
-    int minimum = INT_MAX;
-    int nextIndex;
-    for (int n = 0; n < V; n++) {
-        if (inPath[n] == false && distances[n] <= minimum) {
-            minimum = distances[n];
-            nextIndex = n;
+void siftDown(struct heap *h, int i) {
+    while (1) {
+        int smallest = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        if (l < h->size && h->keys[h->nodes[l]] < h->keys[h->nodes[smallest]]) {
+            smallest = l;
+        }
+        if (r < h->size && h->keys[h->nodes[r]] < h->keys[h->nodes[smallest]]) {
+            smallest = r;
         }
+        if (smallest == i) {
+            return;
+        }
+        heapSwap(h, i, smallest);
+        i = smallest;
     }
-    return nextIndex;
 }
 
-/* findPathToDest()
-Creates a string of the form "XXX-->XXX-->XXX ..." given a destination city, the list of
-cities, and the parent array.
+/* heapPush()
+Adds a vertex to the heap, or moves it up if its distance has been lowered while in the heap.
+*/
+
+void heapPush(struct heap *h, int v) {
+    if (h->pos[v] == -1) {
+        h->nodes[h->size] = v;
+        h->pos[v] = h->size++;
+    }
+    siftUp(h, h->pos[v]);
+}
+
+/* heapPop()
+Removes and returns the vertex with the smallest distance.
 */
 
-int findPathToDest(char path[100], int parent[V], int dest, char cities[V][5]) {
-    int p = parent[dest];
-    char pathStr[100];
-    char helperStr[100];
-    bzero(helperStr, 100);
-    bzero(pathStr, 100);
+int heapPop(struct heap *h) {
+    int top = h->nodes[0];
+    heapSwap(h, 0, --h->size);
+    h->pos[top] = -1;
+    siftDown(h, 0);
+    return top;
+}
+
+/* buildGraph()
+Builds the compressed sparse row graph from a list of (city, city, weight) edges in two passes: the first counts
+each city's edges to place its run, the second fills the runs. Each run is then sorted by neighbour and repeated
+edges are merged, keeping the shortest.
+*/
 
-    // Create the rightmost part of the string
-    strcpy(pathStr, "-->");
-    strcat(pathStr, cities[dest]);
+int buildGraph(struct graph *g, int numNodes, int (*edges)[3], int numEdges) {
+    g->numNodes = numNodes;
+    g->offsets = calloc(numNodes + 1, sizeof(uint32_t));
+    g->targets = malloc(2 * (long) numEdges * sizeof(uint32_t));
+    g->weights = malloc(2 * (long) numEdges * sizeof(int32_t));
 
-    while (p != 0) {
-        // Find next parent and concatenate onto the string
-        strcpy(helperStr, "-->");
-        strcat(helperStr, cities[p]);
-        strcat(helperStr, pathStr);
-        strcpy(pathStr, helperStr);
-        p = parent[p];
-        bzero(helperStr, 100);
+    // First pass: count the edges of each city and turn the counts into run offsets
+    for (int e = 0; e < numEdges; e++) {
+        g->offsets[edges[e][0] + 1]++;
+        g->offsets[edges[e][1] + 1]++;
+    }
+    for (int u = 0; u < numNodes; u++) {
+        g->offsets[u + 1] += g->offsets[u];
     }
 
-    // Add YYC as the first city
-    strcpy(helperStr, "YYC");
-    strcat(helperStr, pathStr);
-    strcpy(pathStr, helperStr);
+    // Second pass: fill each run
+    uint32_t *fill = malloc(numNodes * sizeof(uint32_t));
+    memcpy(fill, g->offsets, numNodes * sizeof(uint32_t));
+    for (int e = 0; e < numEdges; e++) {
+        uint32_t a = fill[edges[e][0]]++;
+        uint32_t b = fill[edges[e][1]]++;
+        g->targets[a] = edges[e][1];
+        g->weights[a] = edges[e][2];
+        g->targets[b] = edges[e][0];
+        g->weights[b] = edges[e][2];
+    }
+    free(fill);
 
-    // copy the string to path and return
-    bzero(path, 100);
-    strcpy(path, pathStr);
+    // Sort each run by neighbour and merge repeated edges, compacting the arrays as it goes
+    uint32_t out = 0;
+    for (int u = 0; u < numNodes; u++) {
+        uint32_t start = g->offsets[u];
+        uint32_t end = g->offsets[u + 1];
+        for (uint32_t i = start + 1; i < end; i++) {
+            uint32_t t = g->targets[i];
+            int32_t w = g->weights[i];
+            uint32_t j = i;
+            while (j > start && g->targets[j - 1] > t) {
+                g->targets[j] = g->targets[j - 1];
+                g->weights[j] = g->weights[j - 1];
+                j--;
+            }
+            g->targets[j] = t;
+            g->weights[j] = w;
+        }
+        g->offsets[u] = out;
+        for (uint32_t i = start; i < end; i++) {
+            if (out > g->offsets[u] && g->targets[out - 1] == g->targets[i]) {
+                if (g->weights[i] < g->weights[out - 1]) {
+                    g->weights[out - 1] = g->weights[i];
+                }
+                continue;
+            }
+            g->targets[out] = g->targets[i];
+            g->weights[out] = g->weights[i];
+            out++;
+        }
+    }
+    g->offsets[numNodes] = out;
+    g->numArcs = out;
+    g->arcCap = 2 * numEdges;
+    g->ownsArcs = 1;
     return 0;
 }
 
+/* runPosition()
+Returns where v is, or would go, in u's run of arcs, found by binary search.
+*/
 
-/* Main()
-Initializes the graph adjacency matrix according to the input file, and then executes Dijkstra's Algorithm. Prints
-the shortest paths for each destination city to the console, as well as the distance it takes to get to each 
-of them from YYC.
-*/
-
-int main() {
-
-    // Initialize cities and graph arrays
-    char cities[V][5];
-    bzero(cities, V*5);
-    int graph[V][V];
-    for (int a = 0; a<V; a++) {
-        for (int b = 0; b<V; b++) {
-            graph[a][b] = INF;
-        }
-    }     
-    
-    char city1[5];
-    char city2[5];
-    bzero(city1, 5);
-    bzero(city2, 5);
-    int weight = 0;
-    char w[5];
-    bzero(w, 5);
-    int numCities = 0;
-    int c1 = 0;
-    int c2 = 0;
-    int index1 = 0;
-    int index2 = 0;
-
-    // Read the first line from the file
-    scanf("%s", city1);
-    scanf("%s", city2);
-    scanf("%s", w);
-    weight = atoi(w);
-
-    // Read the rest of the file and initialize the graph matrix and cities array
-    for (int j = 0; j <= 39; j++) {
-
-        // Check if each city is already in the cities array
-        for (int i = 0; i <= numCities; i++) {
-            if (strcmp(cities[i], city1) == 0) {
-                index1 = i;
-                c1 = 1;
-            }
-            if (strcmp(cities[i], city2) == 0) {
-                index2 = i;
-                c2 = 1;
-            }
-        }
-
-        // If either of the cities are new, add them to the array
-        if (c1 == 0) {
-            strcpy(cities[numCities], city1);
-            index1 = numCities;
-            numCities++;
-            if (c2 == 0) {
-                strcpy(cities[numCities], city2);
-                index2 = numCities;
-                numCities++;
-            }
-
-        } else if (c2 == 0) {
-            strcpy(cities[numCities], city2);
-            index2 = numCities;
-            numCities++;
-        }
-
-        // Add edge to graph adjacency matrix
-        graph[index1][index2] = weight;
-        graph[index2][index1] = weight;
-
-        // Reset variables and read next line
-        c1 = 0;
-        c2 = 0;
-        index1 = 0;
-        index2 = 0;
-        scanf("%s", city1);
-        scanf("%s", city2);
-        scanf("%s", w);
-        weight = atoi(w);
-    }
-
-    // Print the adjacency matrix graph to the screen
-    printf("\nGraph:\n");
-    for (int k = 0; k < 21; k++) {
-        for (int p = 0; p < 21; p++) {
-            printf("%5d ", graph[k][p]);
+uint32_t runPosition(struct graph *g, int u, int v) {
+    uint32_t first = g->offsets[u];
+    uint32_t last = g->offsets[u + 1];
+    while (first < last) {
+        uint32_t mid = (first + last) / 2;
+        if (g->targets[mid] < (uint32_t) v) {
+            first = mid + 1;
+        } else {
+            last = mid;
         }
-        printf("\n");
     }
+    return first;
+}
 
-    // Print the list of cities to the screen
-    printf("\n\nCities:\n");
-    for (int l = 0; l < 21; l++) {
-        printf("%d: %s\n", l, cities[l]);
+/* findRoad()
+Returns the index of the arc from u to v in u's run, or -1 if there is no road between them.
+*/
+
+long findRoad(struct graph *g, int u, int v) {
+    uint32_t i = runPosition(g, u, v);
+    return i < g->offsets[u + 1] && g->targets[i] == (uint32_t) v ? (long) i : -1;
+}
+
+/* moveArcs()
+Opens a gap for one arc (shift 1) or closes one (shift -1) at index at of u's run, moving every later arc along
+and the runs of the vertices after u with them. The arrays are copied out of a mapped file first, and grown when
+full.
+*/
+
+void moveArcs(struct graph *g, int u, uint32_t at, int shift) {
+    if (!g->ownsArcs || g->numArcs + shift > g->arcCap) {
+        uint32_t cap = g->numArcs + g->numArcs / 8 + 16;
+        uint32_t *offsets = malloc((g->numNodes + 1) * sizeof(uint32_t));
+        uint32_t *targets = malloc(cap * sizeof(uint32_t));
+        int32_t *weights = malloc(cap * sizeof(int32_t));
+        memcpy(offsets, g->offsets, (g->numNodes + 1) * sizeof(uint32_t));
+        memcpy(targets, g->targets, g->numArcs * sizeof(uint32_t));
+        memcpy(weights, g->weights, g->numArcs * sizeof(int32_t));
+        if (g->ownsArcs) {
+            free(g->offsets);
+            free(g->targets);
+            free(g->weights);
+        }
+        g->offsets = offsets;
+        g->targets = targets;
+        g->weights = weights;
+        g->arcCap = cap;
+        g->ownsArcs = 1;
+    }
+
+    uint32_t from = shift > 0 ? at : at + 1;
+    memmove(g->targets + from + shift, g->targets + from, (g->numArcs - from) * sizeof(uint32_t));
+    memmove(g->weights + from + shift, g->weights + from, (g->numArcs - from) * sizeof(int32_t));
+    for (int v = u + 1; v <= g->numNodes; v++) {
+        g->offsets[v] += shift;
     }
-    printf("\n\n");
+    g->numArcs += shift;
+}
 
-    // Dijkstra's Algorithm
-    int distances[V];
-    bool inPath[V];
-    int parent[V];
-    char path[100];
+/* setRoad()
+Sets the length of the road between a and b, adding it if there is none, or removes it if length is -1. Returns
+its old length, -1 if there was none. A new length is written in place; a new or removed road is inserted into
+(or taken out of) the two runs by moving the arcs after it.
+*/
 
-    // Initialize distances, inPath, and parent
-    for (int q = 0; q < V; q++) {
-        distances[q] = INT_MAX;
-        inPath[q] = false;
-        parent[q] = -1;
+int setRoad(struct graph *g, int a, int b, int length) {
+    long ab = findRoad(g, a, b);
+    int old = ab == -1 ? -1 : g->weights[ab];
+    if (ab != -1 && length != -1) {
+        g->weights[ab] = length;
+        g->weights[findRoad(g, b, a)] = length;
+        return old;
+    }
+    if (ab == -1 && length == -1) {
+        return old;
+    }
 
-        // Set the parents of nodes neighbouring the start to 0
-        if (graph[0][q] < INF) {
-            parent[q] = 0;
-            distances[q] = graph[0][q];
+    int ends[2][2] = { {a, b}, {b, a} };
+    for (int e = 0; e < 2; e++) {
+        int u = ends[e][0];
+        int v = ends[e][1];
+        uint32_t at = runPosition(g, u, v);
+        moveArcs(g, u, at, length == -1 ? -1 : 1);
+        if (length != -1) {
+            g->targets[at] = v;
+            g->weights[at] = length;
         }
     }
+    return old;
+}
 
-    inPath[0] = true;
-    distances[0] = 0;
+/* cityName()
+Returns the name of a city.
+*/
 
-    // Loop through all remaining cities and find shortest paths to other cities
-    for (int n = 0; n < V-1; n++) {
-        int u = nextNode(distances, inPath);
-        inPath[u] = true;
-        for (int v = 0; v < V; v++) {
-            if (distances[v] == INT_MAX) {
-                distances[v] = distances[u] + graph[u][v];
-                parent[v] = u;
+char *cityName(struct graph *g, int u) {
+    return g->names + g->nameOffsets[u];
+}
+
+/* cityAt()
+Returns the vertex of the city at position i in the map, which is i unless the graph was reordered.
+*/
+
+int cityAt(struct graph *g, int i) {
+    return g->places == NULL ? i : (int) g->places[i];
+}
+
+/* positionOf()
+Returns the position in the map of vertex v, the inverse of cityAt().
+*/
+
+int positionOf(struct graph *g, int v) {
+    return g->positions == NULL ? v : (int) g->positions[v];
+}
+
+/* farEnd()
+Returns a city at the far end of start's part of the map, found by breadth-first searches: each starts from the
+last city the one before reached, of lowest degree among those at its depth, until that gets no deeper. Cities
+whose seen entry is stamp count as visited.
+*/
+
+int farEnd(struct graph *g, int start, int *seen, int *stamp, int *queue) {
+    int far = start;
+    int depth = -1;
+    while (1) {
+        (*stamp)++;
+        int head = 0, tail = 0, levelStart = 0, levels = 0;
+        queue[tail++] = far;
+        seen[far] = *stamp;
+        while (head < tail) {
+            int levelEnd = tail;
+            levelStart = head;
+            for (; head < levelEnd; head++) {
+                int u = queue[head];
+                for (uint32_t i = g->offsets[u]; i < g->offsets[u + 1]; i++) {
+                    int v = g->targets[i];
+                    if (seen[v] != *stamp) {
+                        seen[v] = *stamp;
+                        queue[tail++] = v;
+                    }
+                }
             }
-            else if (distances[v] > distances[u] + graph[u][v]) {
-                distances[v] = distances[u] + graph[u][v];
-                parent[v] = u;
+            levels++;
+        }
+        if (levels <= depth) {
+            return far;
+        }
+        depth = levels;
+        for (int i = levelStart; i < tail; i++) {
+            int v = queue[i];
+            if (g->offsets[v + 1] - g->offsets[v] < g->offsets[far + 1] - g->offsets[far] || i == levelStart) {
+                far = v;
             }
         }
     }
+}
 
-    // Print the paths to the screen
-    printf("\nPaths:\n");
-    for (int t = 1; t < V; t++) {
-        findPathToDest(path, parent, t, cities);
-        printf("%s\n", path);
+/* reorderGraph()
+Renumbers the cities in reverse Cuthill-McKee order: each part of the map is numbered breadth first from a city
+at its far end, a city's neighbours in order of degree, and the whole order is then reversed. Cities a few roads
+apart get close indices, so a search's relaxations read nearby entries of the arc and scratch arrays instead of
+jumping across them. The arcs and names move with their cities, and places records where each city went. Any
+contraction hierarchy is dropped, and landmarks must be chosen afresh.
+*/
+
+int reorderGraph(struct graph *g) {
+    int n = g->numNodes;
+    uint32_t *order = malloc(n * sizeof(uint32_t));     // the city (by position) given each new index
+    uint32_t *place = malloc(n * sizeof(uint32_t));
+    int *seen = calloc(n, sizeof(int));
+    int *queue = malloc(n * sizeof(int));
+    int stamp = 0;
+    int numbered = 0;
+
+    for (int start = 0; start < n; start++) {
+        if (seen[start] == -1) {
+            continue;
+        }
+        int far = farEnd(g, start, seen, &stamp, queue);
+        order[numbered] = far;
+        seen[far] = -1;
+        for (int head = numbered++; head < numbered; head++) {
+            int u = order[head];
+            int first = numbered;
+            for (uint32_t i = g->offsets[u]; i < g->offsets[u + 1]; i++) {
+                int v = g->targets[i];
+                if (seen[v] != -1) {
+                    seen[v] = -1;
+                    order[numbered++] = v;
+                }
+            }
+            for (int i = first + 1; i < numbered; i++) {
+                uint32_t v = order[i];
+                uint32_t degree = g->offsets[v + 1] - g->offsets[v];
+                int j = i;
+                while (j > first && g->offsets[order[j - 1] + 1] - g->offsets[order[j - 1]] > degree) {
+                    order[j] = order[j - 1];
+                    j--;
+                }
+                order[j] = v;
+            }
+        }
+    }
+    for (int i = 0; i < n / 2; i++) {
+        uint32_t v = order[i];
+        order[i] = order[n - 1 - i];
+        order[n - 1 - i] = v;
+    }
+    for (int i = 0; i < n; i++) {
+        place[order[i]] = i;
+    }
+
+    uint32_t *offsets = malloc((n + 1) * sizeof(uint32_t));
+    uint32_t *targets = malloc(g->numArcs * sizeof(uint32_t));
+    int32_t *weights = malloc(g->numArcs * sizeof(int32_t));
+    uint32_t *nameOffsets = malloc(n * sizeof(uint32_t));
+    char *names = malloc(g->nameBytes);
+    uint32_t out = 0, nameAt = 0;
+    for (int k = 0; k < n; k++) {
+        int u = order[k];
+        offsets[k] = out;
+        for (uint32_t i = g->offsets[u]; i < g->offsets[u + 1]; i++) {
+            uint32_t t = place[g->targets[i]];
+            int32_t w = g->weights[i];
+            uint32_t j = out++;
+            while (j > offsets[k] && targets[j - 1] > t) {
+                targets[j] = targets[j - 1];
+                weights[j] = weights[j - 1];
+                j--;
+            }
+            targets[j] = t;
+            weights[j] = w;
+        }
+        size_t len = strlen(cityName(g, u)) + 1;
+        memcpy(names + nameAt, cityName(g, u), len);
+        nameOffsets[k] = nameAt;
+        nameAt += len;
+    }
+    offsets[n] = out;
+
+    if (g->ownsArcs) {
+        free(g->offsets);
+        free(g->targets);
+        free(g->weights);
+    }
+    g->offsets = offsets;
+    g->targets = targets;
+    g->weights = weights;
+    g->arcCap = g->numArcs;
+    g->ownsArcs = 1;
+    g->nameOffsets = nameOffsets;
+    g->names = names;
+    g->ranks = NULL;
+    g->numUpArcs = 0;
+    if (g->places != NULL) {
+        // Already reordered once: the vertices being placed are not positions in the map
+        for (int i = 0; i < n; i++) {
+            order[place[g->places[i]]] = i;
+            seen[i] = place[g->places[i]];
+        }
+        for (int i = 0; i < n; i++) {
+            place[i] = seen[i];
+        }
+    }
+    g->places = place;
+    g->positions = order;
+    free(seen);
+    free(queue);
+    return 0;
+}
+
+/* mapFile()
+Maps a whole file into memory privately, so changes made to it (to road lengths) stay in memory, and stores its
+length in len. Input that cannot be mapped (a pipe on
+standard input, when path is NULL) is read into a buffer instead.
+*/
+
+char *mapFile(char *path, size_t *len) {
+    int fd = path == NULL ? 0 : open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        printf("Could not open %s\n", path);
+        exit(1);
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            printf("Could not map %s\n", path);
+            exit(1);
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        *len = st.st_size;
+        return data;
+    }
+
+    size_t cap = 1 << 16;
+    char *data = malloc(cap);
+    *len = 0;
+    ssize_t n;
+    while ((n = read(fd, data + *len, cap - *len)) > 0) {
+        *len += n;
+        if (*len == cap) {
+            cap *= 2;
+            data = realloc(data, cap);
+        }
+    }
+    return data;
+}
+
+/* hashName()
+Returns the FNV-1a hash of the len characters of a city name.
+*/
+
+uint32_t hashName(const char *name, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* findCity()
+Returns the index of the city whose name is the len characters at name, or -1 if there is none.
+*/
+
+int findCity(struct graph *g, struct name_table *t, const char *name, int len) {
+    for (uint32_t s = hashName(name, len) & t->mask; t->slots[s] != 0; s = (s + 1) & t->mask) {
+        char *known = cityName(g, t->slots[s] - 1);
+        if (strncmp(known, name, len) == 0 && known[len] == '\0') {
+            return t->slots[s] - 1;
+        }
+    }
+    return -1;
+}
+
+/* indexCities()
+Builds the hash table over all cities of a graph, with room for as many again.
+*/
+
+int indexCities(struct graph *g, struct name_table *t) {
+    uint32_t cap = 64;
+    while (cap < 4 * (uint32_t) g->numNodes) {
+        cap *= 2;
+    }
+    t->mask = cap - 1;
+    t->slots = calloc(cap, sizeof(uint32_t));
+    for (int v = 0; v < g->numNodes; v++) {
+        char *name = cityName(g, v);
+        uint32_t s = hashName(name, strlen(name)) & t->mask;
+        while (t->slots[s] != 0) {
+            s = (s + 1) & t->mask;
+        }
+        t->slots[s] = v + 1;
+    }
+    return 0;
+}
+
+/* internCity()
+Returns the index of the city whose name is the len characters at name, adding it to the graph's name table
+(and the hash table, which is rebuilt twice as large when half full) if it is new.
+*/
+
+int internCity(struct graph *g, struct name_table *t, uint32_t *nameCap, const char *name, int len) {
+    int u = findCity(g, t, name, len);
+    if (u != -1) {
+        return u;
+    }
+
+    // A new city: store its name and index it
+    u = g->numNodes++;
+    if (g->nameBytes + len + 1 > *nameCap) {
+        while (g->nameBytes + len + 1 > *nameCap) {
+            *nameCap *= 2;
+        }
+        g->names = realloc(g->names, *nameCap);
+    }
+    if ((u & (u - 1)) == 0 && u >= 64) {
+        g->nameOffsets = realloc(g->nameOffsets, 2 * u * sizeof(uint32_t));
+    }
+    g->nameOffsets[u] = g->nameBytes;
+    memcpy(g->names + g->nameBytes, name, len);
+    g->names[g->nameBytes + len] = '\0';
+    g->nameBytes += len + 1;
+
+    if (2 * (uint32_t) g->numNodes > t->mask) {
+        free(t->slots);
+        indexCities(g, t);
+        return u;
+    }
+    uint32_t s = hashName(name, len) & t->mask;
+    while (t->slots[s] != 0) {
+        s = (s + 1) & t->mask;
+    }
+    t->slots[s] = u + 1;
+    return u;
+}
+
+/* parseMap()
+Parses a map of "<city> <city> <distance>" lines (any whitespace between the fields) without copying it, giving
+each city an index in the order it first appears, and builds the graph from it.
+*/
+
+int parseMap(struct graph *g, const char *data, size_t len) {
+    const char *p = data;
+    const char *end = data + len;
+    uint32_t nameCap = 1 << 12;
+    int edgeCap = 64;
+    int numEdges = 0;
+    int (*edges)[3] = malloc(edgeCap * sizeof(*edges));
+    struct name_table table = { 63, calloc(64, sizeof(uint32_t)) };
+
+    g->numNodes = 0;
+    g->nameBytes = 0;
+    g->numLandmarks = 0;
+    g->landmarks = NULL;
+    g->landmarkDist = NULL;
+    g->ranks = NULL;
+    g->numUpArcs = 0;
+    g->places = NULL;
+    g->positions = NULL;
+    g->names = malloc(nameCap);
+    g->nameOffsets = malloc(64 * sizeof(uint32_t));
+
+    while (1) {
+        int index[2];
+        for (int c = 0; c < 2; c++) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+                p++;
+            }
+            const char *name = p;
+            while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+                p++;
+            }
+            if (p == name) {
+                break;
+            }
+            index[c] = internCity(g, &table, &nameCap, name, p - name);
+        }
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+
+        int weight = 0;
+        const char *digits = p;
+        while (p < end && *p >= '0' && *p <= '9') {
+            weight = weight * 10 + (*p++ - '0');
+        }
+        if (p == digits) {
+            printf("Bad distance after edge %d\n", numEdges + 1);
+            exit(1);
+        }
+
+        if (numEdges == edgeCap) {
+            edgeCap *= 2;
+            edges = realloc(edges, edgeCap * sizeof(*edges));
+        }
+        edges[numEdges][0] = index[0];
+        edges[numEdges][1] = index[1];
+        edges[numEdges][2] = weight;
+        numEdges++;
+    }
+
+    free(table.slots);
+    buildGraph(g, g->numNodes, edges, numEdges);
+    free(edges);
+    return 0;
+}
+
+/* saveGraph()
+Writes a graph to a compiled graph file: the header followed by the CSR arrays, the name table, the landmark
+distances, the contraction hierarchy if there is one and the places of the cities if they were reordered.
+*/
+
+int saveGraph(struct graph *g, char *path) {
+    struct graph_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GRAPHMAGIC, sizeof(GRAPHMAGIC));
+    header.version = GRAPHVERSION;
+    header.numNodes = g->numNodes;
+    header.numArcs = g->numArcs;
+    header.nameBytes = g->nameBytes;
+    header.numLandmarks = g->numLandmarks;
+    header.numUpArcs = g->numUpArcs;
+
+    int hierarchy = g->ranks != NULL;
+    void *data[NUMSECTIONS] = {
+        g->offsets, g->targets, g->weights, g->nameOffsets, g->names, g->landmarks, g->landmarkDist,
+        g->ranks, g->upOffsets, g->upTargets, g->upWeights, g->upMiddles, g->places
+    };
+    uint64_t lengths[NUMSECTIONS] = {
+        (g->numNodes + 1) * sizeof(uint32_t), g->numArcs * sizeof(uint32_t), g->numArcs * sizeof(int32_t),
+        g->numNodes * sizeof(uint32_t), g->nameBytes, g->numLandmarks * sizeof(uint32_t),
+        (uint64_t) g->numNodes * g->numLandmarks * sizeof(int32_t),
+        hierarchy * g->numNodes * sizeof(uint32_t), hierarchy * (g->numNodes + 1) * sizeof(uint32_t),
+        g->numUpArcs * sizeof(uint32_t), g->numUpArcs * sizeof(int32_t), g->numUpArcs * sizeof(int32_t),
+        (g->places != NULL) * g->numNodes * sizeof(uint32_t)
+    };
+    uint64_t at = (sizeof(header) + 7) & ~7UL;
+    for (int i = 0; i < NUMSECTIONS; i++) {
+        header.sections[i][0] = at;
+        header.sections[i][1] = lengths[i];
+        at = (at + lengths[i] + 7) & ~7UL;
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        printf("Could not create %s\n", path);
+        exit(1);
+    }
+    fwrite(&header, sizeof(header), 1, f);
+    for (int i = 0; i < NUMSECTIONS; i++) {
+        fseek(f, header.sections[i][0], SEEK_SET);
+        fwrite(data[i], 1, lengths[i], f);
+    }
+    if (fclose(f) != 0) {
+        printf("Could not write %s\n", path);
+        exit(1);
+    }
+    return 0;
+}
+
+/* loadGraph()
+Loads a graph from a map file, or from standard input if path is NULL. A compiled graph file is used in place:
+its arrays point into the mapping, apart from the positions of a reordered graph's vertices, which are worked out
+from their places. Anything else is parsed as a text map.
+*/
+
+int loadGraph(struct graph *g, char *path) {
+    size_t len;
+    char *data = mapFile(path, &len);
+    struct graph_header *header = (struct graph_header *) data;
+
+    if (len < sizeof(*header) || memcmp(header->magic, GRAPHMAGIC, sizeof(GRAPHMAGIC)) != 0) {
+        parseMap(g, data, len);
+        return 0;
+    }
+    if (header->version != GRAPHVERSION || header->numLandmarks > MAXLANDMARKS) {
+        printf("%s is compiled graph version %u, expected %d\n", path, header->version, GRAPHVERSION);
+        exit(1);
+    }
+    for (int i = 0; i < NUMSECTIONS; i++) {
+        if (header->sections[i][0] + header->sections[i][1] > len) {
+            printf("%s is truncated\n", path);
+            exit(1);
+        }
+    }
+
+    g->numNodes = header->numNodes;
+    g->ownsArcs = 0;
+    g->numArcs = header->numArcs;
+    g->nameBytes = header->nameBytes;
+    g->offsets = (uint32_t *) (data + header->sections[OFFSETS][0]);
+    g->targets = (uint32_t *) (data + header->sections[TARGETS][0]);
+    g->weights = (int32_t *) (data + header->sections[WEIGHTS][0]);
+    g->nameOffsets = (uint32_t *) (data + header->sections[NAMEOFFSETS][0]);
+    g->names = data + header->sections[NAMES][0];
+    g->numLandmarks = header->numLandmarks;
+    g->landmarks = (uint32_t *) (data + header->sections[LANDMARKS][0]);
+    g->landmarkDist = (int32_t *) (data + header->sections[LANDMARKDIST][0]);
+    g->ranks = header->sections[RANKS][1] == 0 ? NULL : (uint32_t *) (data + header->sections[RANKS][0]);
+    g->numUpArcs = header->numUpArcs;
+    g->upOffsets = (uint32_t *) (data + header->sections[UPOFFSETS][0]);
+    g->upTargets = (uint32_t *) (data + header->sections[UPTARGETS][0]);
+    g->upWeights = (int32_t *) (data + header->sections[UPWEIGHTS][0]);
+    g->upMiddles = (int32_t *) (data + header->sections[UPMIDDLES][0]);
+    g->places = NULL;
+    g->positions = NULL;
+    if (header->sections[PLACES][1] != 0) {
+        g->places = (uint32_t *) (data + header->sections[PLACES][0]);
+        g->positions = malloc(g->numNodes * sizeof(uint32_t));
+        for (int i = 0; i < g->numNodes; i++) {
+            g->positions[g->places[i]] = i;
+        }
+    }
+    return 0;
+}
+
+/* initSearch()
+Allocates the search state for a graph of n vertices.
+*/
+
+int initSearch(struct search *s, int n) {
+    s->gen = 0;
+    s->stamp = calloc(n, sizeof(uint32_t));
+    s->dist = malloc(n * sizeof(int));
+    s->parent = malloc(n * sizeof(int));
+    s->prio = malloc(n * sizeof(int));
+    s->settled = 0;
+    s->heap = malloc(sizeof(struct heap));
+    s->heap->size = 0;
+    s->heap->nodes = malloc(n * sizeof(int));
+    s->heap->pos = malloc(n * sizeof(int));
+    s->heap->keys = s->dist;
+    return 0;
+}
+
+/* freeSearch()
+Frees the search state.
+*/
+
+int freeSearch(struct search *s) {
+    free(s->stamp);
+    free(s->dist);
+    free(s->parent);
+    free(s->prio);
+    free(s->heap->nodes);
+    free(s->heap->pos);
+    free(s->heap);
+    return 0;
+}
+
+/* reach()
+Makes a vertex's entries valid for the current search, as unreached, the first time the search touches it.
+*/
+
+void reach(struct search *s, int v) {
+    if (s->stamp[v] != s->gen) {
+        s->stamp[v] = s->gen;
+        s->dist[v] = INT_MAX;
+        s->parent[v] = -1;
+        s->heap->pos[v] = -1;
+    }
+}
+
+/* startSearch()
+Starts a new generation of a search, so entries left by earlier searches are ignored rather than cleared, and
+puts the source in a heap ordered by keys (the search's dist or prio array).
+*/
+
+void startSearch(struct search *s, struct graph *g, int source, int *keys) {
+    if (++s->gen == 0) {
+        memset(s->stamp, 0, g->numNodes * sizeof(uint32_t));
+        s->gen = 1;
+    }
+    s->heap->size = 0;
+    s->heap->keys = keys;
+    s->settled = 0;
+    reach(s, source);
+    s->dist[source] = 0;
+    s->prio[source] = 0;
+    heapPush(s->heap, source);
+}
+
+/* searchFrom()
+Runs Dijkstra's Algorithm from source, stopping once target is settled (or when every reachable vertex is, if
+target is -1).
+*/
+
+int searchFrom(struct search *s, struct graph *g, int source, int target) {
+    struct heap *h = s->heap;
+    startSearch(s, g, source, s->dist);
+
+    // Settle the closest vertex and relax its edges until the target (or every reachable vertex) is settled
+    while (h->size > 0) {
+        int u = heapPop(h);
+        s->settled++;
+        if (u == target) {
+            break;
+        }
+        for (uint32_t i = g->offsets[u]; i < g->offsets[u + 1]; i++) {
+            int v = g->targets[i];
+            int w = g->weights[i];
+            reach(s, v);
+            if (s->dist[u] + w < s->dist[v]) {
+                s->dist[v] = s->dist[u] + w;
+                s->parent[v] = u;
+                heapPush(h, v);
+            }
+        }
+    }
+    return 0;
+}
+
+/* searchBetween()
+Runs Dijkstra's Algorithm from source in f and from target in b at once, each step settling the closer of the two
+heap tops. A vertex reached from both sides is a candidate meeting point, and the search stops once the two heap
+tops together are no shorter than the best candidate's route: any shorter route would have to pass through a
+vertex neither side has settled, and so be longer than both tops added. Returns the meeting point of a shortest
+route, or -1 if there is none.
+*/
+
+int searchBetween(struct search *f, struct search *b, struct graph *g, int source, int target) {
+    startSearch(f, g, source, f->dist);
+    startSearch(b, g, target, b->dist);
+    if (source == target) {
+        return source;
+    }
+    int best = INT_MAX;
+    int meet = -1;
+
+    while (f->heap->size > 0 && b->heap->size > 0) {
+        int topF = f->dist[f->heap->nodes[0]];
+        int topB = b->dist[b->heap->nodes[0]];
+        if ((long) topF + topB >= best) {
+            break;
+        }
+        struct search *s = topF <= topB ? f : b;
+        struct search *other = s == f ? b : f;
+
+        int u = heapPop(s->heap);
+        s->settled++;
+        for (uint32_t i = g->offsets[u]; i < g->offsets[u + 1]; i++) {
+            int v = g->targets[i];
+            int w = g->weights[i];
+            reach(s, v);
+            if (s->dist[u] + w >= s->dist[v]) {
+                continue;
+            }
+            s->dist[v] = s->dist[u] + w;
+            s->parent[v] = u;
+            heapPush(s->heap, v);
+            if (other->stamp[v] == other->gen && other->dist[v] != INT_MAX && s->dist[v] + other->dist[v] < best) {
+                best = s->dist[v] + other->dist[v];
+                meet = v;
+            }
+        }
+    }
+    return meet;
+}
+
+/* lowerBound()
+Returns a lower bound on the distance from v to the target, given the target's landmark distances. By the
+triangle inequality a route is at least as long as the difference of its ends' distances to any landmark.
+*/
+
+int lowerBound(struct graph *g, int v, int32_t *toTarget) {
+    int32_t *fromV = g->landmarkDist + (long) v * g->numLandmarks;
+    int best = 0;
+    for (int l = 0; l < g->numLandmarks; l++) {
+        if (fromV[l] == INT_MAX || toTarget[l] == INT_MAX) {
+            continue;
+        }
+        int bound = fromV[l] > toTarget[l] ? fromV[l] - toTarget[l] : toTarget[l] - fromV[l];
+        if (bound > best) {
+            best = bound;
+        }
+    }
+    return best;
+}
+
+/* searchAlt()
+Runs A* from source to target, settling vertices in order of their distance plus the landmark lower bound on the
+rest of the way. The bounds never overestimate and never drop by more than an edge's length across it, so each
+vertex is settled once, at its true distance, as in Dijkstra's Algorithm; the search is just drawn towards the
+target. A vertex's bound is worked out when it is first reached and kept as its priority less its distance.
+*/
+
+int searchAlt(struct search *s, struct graph *g, int source, int target) {
+    int32_t *toTarget = g->landmarkDist + (long) target * g->numLandmarks;
+    struct heap *h = s->heap;
+    startSearch(s, g, source, s->prio);
+
+    while (h->size > 0) {
+        int u = heapPop(h);
+        s->settled++;
+        if (u == target) {
+            break;
+        }
+        for (uint32_t i = g->offsets[u]; i < g->offsets[u + 1]; i++) {
+            int v = g->targets[i];
+            int d = s->dist[u] + g->weights[i];
+            reach(s, v);
+            if (d < s->dist[v]) {
+                int rest = s->dist[v] == INT_MAX ? lowerBound(g, v, toTarget) : s->prio[v] - s->dist[v];
+                s->dist[v] = d;
+                s->prio[v] = d + rest;
+                s->parent[v] = u;
+                heapPush(h, v);
+            }
+        }
+    }
+    return 0;
+}
+
+/* witnessSearch()
+Runs the thread's search, just started from a neighbour of avoid, over the vertices still to be contracted other
+than avoid. It stops once all numTargets marked targets are settled, the closest vertex is farther than limit or
+maxSettled vertices are settled. Any vertex reached is then at most its distance from the neighbour without
+passing through avoid.
+*/
+
+int witnessSearch(struct contraction *c, struct contractor *t, int avoid, int limit, int numTargets, int maxSettled) {
+    struct search *s = &t->search;
+    struct heap *h = s->heap;
+
+    while (h->size > 0 && s->settled < maxSettled && numTargets > 0) {
+        int u = heapPop(h);
+        s->settled++;
+        if (s->dist[u] > limit) {
+            break;
+        }
+        if (t->target[u] == s->gen) {
+            numTargets--;
+        }
+        struct ch_node *node = &c->nodes[u];
+        for (int i = 0; i < node->degree; i++) {
+            int v = node->arcs[i].target;
+            if (v == avoid || c->state[v] != REMAINING) {
+                continue;
+            }
+            reach(s, v);
+            if (s->dist[u] + node->arcs[i].weight < s->dist[v]) {
+                s->dist[v] = s->dist[u] + node->arcs[i].weight;
+                heapPush(h, v);
+            }
+        }
+    }
+    return 0;
+}
+
+/* findShortcuts()
+Works out which shortcuts contracting v needs: one between each pair of its neighbours u and w unless a witness
+search from u finds a path to w avoiding v that is no longer than the one through it. Returns how many there are,
+and records them if record is set (otherwise the searches are cut short sooner, as only the count matters). Each
+search looks for the neighbours after u, and goes no farther than the longest way to them through v.
+*/
+
+int findShortcuts(struct contraction *c, struct contractor *t, int v, int record) {
+    struct ch_node *node = &c->nodes[v];
+    struct search *s = &t->search;
+    int count = 0;
+
+    for (int i = 0; i < node->degree - 1; i++) {
+        int u = node->arcs[i].target;
+        int longest = 0;
+        startSearch(s, c->g, u, s->dist);
+        for (int j = i + 1; j < node->degree; j++) {
+            t->target[node->arcs[j].target] = s->gen;
+            if (node->arcs[j].weight > longest) {
+                longest = node->arcs[j].weight;
+            }
+        }
+        witnessSearch(c, t, v, node->arcs[i].weight + longest, node->degree - 1 - i,
+                      record ? WITNESSLIMIT : ESTIMATELIMIT);
+
+        for (int j = i + 1; j < node->degree; j++) {
+            int w = node->arcs[j].target;
+            int via = node->arcs[i].weight + node->arcs[j].weight;
+            if (s->stamp[w] == s->gen && s->dist[w] <= via) {
+                continue;
+            }
+            count++;
+            if (!record) {
+                continue;
+            }
+            if (t->numFound == t->foundCap) {
+                t->foundCap = 2 * t->foundCap + 64;
+                t->found = realloc(t->found, t->foundCap * sizeof(*t->found));
+            }
+            int *found = t->found[t->numFound++];
+            found[0] = u;
+            found[1] = w;
+            found[2] = via;
+            found[3] = v;
+        }
+    }
+    return count;
+}
+
+/* isLocalMinimum()
+Returns 1 if v comes before all its remaining neighbours in contraction order (lower priority, or the same and a
+lower index), so that the vertices of a round are never adjacent.
+*/
+
+int isLocalMinimum(struct contraction *c, int v) {
+    struct ch_node *node = &c->nodes[v];
+    for (int i = 0; i < node->degree; i++) {
+        int u = node->arcs[i].target;
+        if (c->priority[u] < c->priority[v] || (c->priority[u] == c->priority[v] && u < v)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* contractWorker()
+Preprocessing thread. Takes WORKCHUNK vertices at a time of the current phase's work until none are left, and
+for each works out its priority, whether it is contracted this round, or the shortcuts its contraction adds.
+*/
+
+void *contractWorker(void *arg) {
+    struct contractor *t = arg;
+    struct contraction *c = t->c;
+
+    while (1) {
+        int start = __atomic_fetch_add(&c->next, WORKCHUNK, __ATOMIC_RELAXED);
+        if (start >= c->workSize) {
+            break;
+        }
+        int end = start + WORKCHUNK < c->workSize ? start + WORKCHUNK : c->workSize;
+        for (int i = start; i < end; i++) {
+            int v = c->work[i];
+            if (c->phase == ORDERING) {
+                c->priority[v] = findShortcuts(c, t, v, 0) - c->nodes[v].degree + c->deleted[v];
+            } else if (c->phase == SELECTING) {
+                c->selected[v] = isLocalMinimum(c, v);
+            } else {
+                findShortcuts(c, t, v, 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* runPhase()
+Runs one preprocessing phase over a list of vertices on every thread, and waits for them all to finish.
+*/
+
+int runPhase(struct contraction *c, struct contractor *threads, int numThreads, int phase, int *work, int size) {
+    c->phase = phase;
+    c->work = work;
+    c->workSize = size;
+    c->next = 0;
+    for (int i = 0; i < numThreads; i++) {
+        if (pthread_create(&threads[i].thread, NULL, contractWorker, &threads[i]) != 0) {
+            printf("Could not start preprocessing thread %d\n", i);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    return 0;
+}
+
+/* addArc()
+Adds an edge from u to w during contraction, or shortens the one already there.
+*/
+
+int addArc(struct ch_node *node, int w, int weight, int middle) {
+    for (int i = 0; i < node->degree; i++) {
+        if (node->arcs[i].target == (uint32_t) w) {
+            if (weight < node->arcs[i].weight) {
+                node->arcs[i].weight = weight;
+                node->arcs[i].middle = middle;
+            }
+            return 0;
+        }
+    }
+    if (node->degree == node->cap) {
+        node->cap = 2 * node->cap + 4;
+        node->arcs = realloc(node->arcs, node->cap * sizeof(struct ch_arc));
+    }
+    node->arcs[node->degree++] = (struct ch_arc) { w, weight, middle };
+    return 0;
+}
+
+/* removeArc()
+Removes a vertex's edge to a contracted vertex.
+*/
+
+int removeArc(struct ch_node *node, int v) {
+    for (int i = 0; i < node->degree; i++) {
+        if (node->arcs[i].target == (uint32_t) v) {
+            node->arcs[i] = node->arcs[--node->degree];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* buildHierarchy()
+Builds a contraction hierarchy on numThreads threads. Vertices are contracted in rounds, lowest priority (edge
+difference: shortcuts added less edges removed, plus neighbours already contracted) first. Each round takes every
+remaining vertex that comes before all its neighbours, so no two are adjacent and their witness searches can run
+in parallel while the graph stays fixed. The shortcuts are then added, the round's vertices removed, and their
+neighbours' priorities worked out again. When a vertex is contracted its remaining edges become its arcs up the
+hierarchy, which end up in the graph's up arrays.
+*/
+
+int buildHierarchy(struct graph *g, int numThreads) {
+    int n = g->numNodes;
+    struct contraction c;
+    c.g = g;
+    c.nodes = calloc(n, sizeof(struct ch_node));
+    c.state = calloc(n, 1);
+    c.selected = calloc(n, 1);
+    c.priority = malloc(n * sizeof(int));
+    c.deleted = calloc(n, sizeof(int));
+    for (int u = 0; u < n; u++) {
+        struct ch_node *node = &c.nodes[u];
+        node->degree = node->cap = g->offsets[u + 1] - g->offsets[u];
+        node->arcs = malloc(node->cap * sizeof(struct ch_arc));
+        for (int i = 0; i < node->degree; i++) {
+            node->arcs[i] = (struct ch_arc) { g->targets[g->offsets[u] + i], g->weights[g->offsets[u] + i], -1 };
+        }
+    }
+
+    struct contractor *threads = calloc(numThreads, sizeof(struct contractor));
+    for (int i = 0; i < numThreads; i++) {
+        threads[i].c = &c;
+        initSearch(&threads[i].search, n);
+        threads[i].target = calloc(n, sizeof(uint32_t));
+    }
+
+    int *remaining = malloc(n * sizeof(int));
+    int *round = malloc(n * sizeof(int));
+    int *dirty = malloc(n * sizeof(int));
+    uint8_t *isDirty = calloc(n, 1);
+    int numRemaining = n;
+    for (int v = 0; v < n; v++) {
+        remaining[v] = v;
+    }
+    runPhase(&c, threads, numThreads, ORDERING, remaining, n);
+
+    g->ranks = malloc(n * sizeof(uint32_t));
+    uint32_t rank = 0;
+    while (numRemaining > 0) {
+        // Choose the round's vertices and find their shortcuts
+        runPhase(&c, threads, numThreads, SELECTING, remaining, numRemaining);
+        int roundSize = 0;
+        int kept = 0;
+        for (int i = 0; i < numRemaining; i++) {
+            int v = remaining[i];
+            if (c.selected[v]) {
+                round[roundSize++] = v;
+                c.state[v] = INROUND;
+            } else {
+                remaining[kept++] = v;
+            }
+        }
+        numRemaining = kept;
+        runPhase(&c, threads, numThreads, CONTRACTING, round, roundSize);
+
+        // Add the shortcuts, then take the round's vertices out of the graph
+        for (int i = 0; i < numThreads; i++) {
+            for (int f = 0; f < threads[i].numFound; f++) {
+                int *found = threads[i].found[f];
+                addArc(&c.nodes[found[0]], found[1], found[2], found[3]);
+                addArc(&c.nodes[found[1]], found[0], found[2], found[3]);
+            }
+            threads[i].numFound = 0;
+        }
+        int numDirty = 0;
+        for (int i = 0; i < roundSize; i++) {
+            int v = round[i];
+            g->ranks[v] = rank++;
+            c.state[v] = CONTRACTED;
+            for (int a = 0; a < c.nodes[v].degree; a++) {
+                int u = c.nodes[v].arcs[a].target;
+                removeArc(&c.nodes[u], v);
+                c.deleted[u]++;
+                if (!isDirty[u]) {
+                    isDirty[u] = 1;
+                    dirty[numDirty++] = u;
+                }
+            }
+        }
+        for (int i = 0; i < numDirty; i++) {
+            isDirty[dirty[i]] = 0;
+        }
+        runPhase(&c, threads, numThreads, ORDERING, dirty, numDirty);
+    }
+
+    // Each vertex's edges left at its contraction are its arcs up the hierarchy: lay them out sorted by target
+    g->upOffsets = malloc((n + 1) * sizeof(uint32_t));
+    g->upOffsets[0] = 0;
+    for (int u = 0; u < n; u++) {
+        g->upOffsets[u + 1] = g->upOffsets[u] + c.nodes[u].degree;
+    }
+    g->numUpArcs = g->upOffsets[n];
+    g->upTargets = malloc(g->numUpArcs * sizeof(uint32_t));
+    g->upWeights = malloc(g->numUpArcs * sizeof(int32_t));
+    g->upMiddles = malloc(g->numUpArcs * sizeof(int32_t));
+    for (int u = 0; u < n; u++) {
+        struct ch_node *node = &c.nodes[u];
+        for (int i = 1; i < node->degree; i++) {
+            struct ch_arc arc = node->arcs[i];
+            int j = i;
+            while (j > 0 && node->arcs[j - 1].target > arc.target) {
+                node->arcs[j] = node->arcs[j - 1];
+                j--;
+            }
+            node->arcs[j] = arc;
+        }
+        for (int i = 0; i < node->degree; i++) {
+            g->upTargets[g->upOffsets[u] + i] = node->arcs[i].target;
+            g->upWeights[g->upOffsets[u] + i] = node->arcs[i].weight;
+            g->upMiddles[g->upOffsets[u] + i] = node->arcs[i].middle;
+        }
+        free(node->arcs);
+    }
+
+    for (int i = 0; i < numThreads; i++) {
+        freeSearch(&threads[i].search);
+        free(threads[i].target);
+        free(threads[i].found);
+    }
+    free(threads);
+    free(c.nodes);
+    free(c.state);
+    free(c.selected);
+    free(c.priority);
+    free(c.deleted);
+    free(remaining);
+    free(round);
+    free(dirty);
+    free(isDirty);
+    return 0;
+}
+
+/* searchHierarchy()
+Searches a contraction hierarchy from source in f and from target in b at once, each only along arcs up the
+hierarchy and each step settling the closer of the two heap tops. The highest-ranked vertex of a shortest route
+is reached from both ends, so the search stops once both tops are at least as far as the best vertex reached
+from both. Returns that vertex, or -1 if there is no route.
+*/
+
+int searchHierarchy(struct search *f, struct search *b, struct graph *g, int source, int target) {
+    startSearch(f, g, source, f->dist);
+    startSearch(b, g, target, b->dist);
+    if (source == target) {
+        return source;
+    }
+    int best = INT_MAX;
+    int meet = -1;
+
+    while (f->heap->size > 0 || b->heap->size > 0) {
+        int topF = f->heap->size > 0 ? f->dist[f->heap->nodes[0]] : INT_MAX;
+        int topB = b->heap->size > 0 ? b->dist[b->heap->nodes[0]] : INT_MAX;
+        if (topF >= best && topB >= best) {
+            break;
+        }
+        struct search *s = topF <= topB ? f : b;
+        struct search *other = s == f ? b : f;
+
+        int u = heapPop(s->heap);
+        s->settled++;
+        for (uint32_t i = g->upOffsets[u]; i < g->upOffsets[u + 1]; i++) {
+            int v = g->upTargets[i];
+            int w = g->upWeights[i];
+            reach(s, v);
+            if (s->dist[u] + w >= s->dist[v]) {
+                continue;
+            }
+            s->dist[v] = s->dist[u] + w;
+            s->parent[v] = u;
+            heapPush(s->heap, v);
+            if (other->stamp[v] == other->gen && other->dist[v] != INT_MAX && s->dist[v] + other->dist[v] < best) {
+                best = s->dist[v] + other->dist[v];
+                meet = v;
+            }
+        }
+    }
+    return meet;
+}
+
+/* unpackArc()
+Appends the cities along the hierarchy arc from a to b, after a and up to b, to nodes and returns the new count.
+The arc is looked up in the arcs of whichever end ranks lower, and a shortcut is replaced by the two arcs through
+the city it bypasses, which ranks lower than both ends, until only roads are left.
+*/
+
+int unpackArc(struct graph *g, int a, int b, int *nodes, int n) {
+    int lo = g->ranks[a] < g->ranks[b] ? a : b;
+    uint32_t hi = lo == a ? b : a;
+    uint32_t first = g->upOffsets[lo];
+    uint32_t last = g->upOffsets[lo + 1];
+    while (first < last) {
+        uint32_t mid = (first + last) / 2;
+        if (g->upTargets[mid] < hi) {
+            first = mid + 1;
+        } else {
+            last = mid;
+        }
+    }
+    int middle = g->upMiddles[first];
+    if (middle == -1) {
+        nodes[n++] = b;
+        return n;
+    }
+    n = unpackArc(g, a, middle, nodes, n);
+    return unpackArc(g, middle, b, nodes, n);
+}
+
+/* pushVertex()
+Appends a vertex to a growable list.
+*/
+
+void pushVertex(int **list, int *size, int *cap, int v) {
+    if (*size == *cap) {
+        *cap = 2 * *cap + 16;
+        *list = realloc(*list, *cap * sizeof(int));
+    }
+    (*list)[(*size)++] = v;
+}
+
+/* relaxAtomic()
+Offers v a distance of dist through u. If that is shorter than what v has (or as short, through a lower parent) it
+is stored with one compare-and-swap, retried while other threads change v, and a shorter distance puts v in the
+bucket of that distance.
+*/
+
+void relaxAtomic(struct delta_thread *t, int u, int v, uint32_t dist) {
+    struct delta_stepping *d = t->d;
+    uint64_t offer = (uint64_t) dist << 32 | (uint32_t) u;
+    uint64_t old = __atomic_load_n(&d->best[v], __ATOMIC_RELAXED);
+    while (offer < old) {
+        if (__atomic_compare_exchange_n(&d->best[v], &old, offer, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            if (dist < old >> 32) {
+                int slot = (dist / d->delta) % d->numBuckets;
+                pushVertex(&t->buckets[slot], &t->sizes[slot], &t->caps[slot], v);
+            }
+            return;
+        }
+    }
+}
+
+/* gatherBucket()
+Moves the vertices every thread has put in the current bucket into the frontier, leaving out repeats and those
+whose distance has since dropped into a bucket already settled. Run by one thread while the others wait.
+*/
+
+int gatherBucket(struct delta_stepping *d) {
+    int slot = d->bucket % d->numBuckets;
+    d->gatherGen++;
+    d->frontierSize = 0;
+    d->next = 0;
+    for (int i = 0; i < d->numThreads; i++) {
+        struct delta_thread *t = &d->threads[i];
+        for (int j = 0; j < t->sizes[slot]; j++) {
+            int v = t->buckets[slot][j];
+            if ((d->best[v] >> 32) / d->delta == (uint64_t) d->bucket && d->queued[v] != d->gatherGen) {
+                d->queued[v] = d->gatherGen;
+                d->frontier[d->frontierSize++] = v;
+            }
+        }
+        t->sizes[slot] = 0;
+    }
+    return d->frontierSize;
+}
+
+/* nextBucket()
+Moves on to the next bucket with any vertices in it and gathers them, or sets done if every bucket is empty. Run
+by one thread while the others wait.
+*/
+
+int nextBucket(struct delta_stepping *d) {
+    for (int ahead = 0; ahead < d->numBuckets; ahead++) {
+        d->bucket++;
+        if (gatherBucket(d) > 0) {
+            return 0;
+        }
+    }
+    d->done = 1;
+    return 0;
+}
+
+/* deltaWorker()
+Delta-stepping thread. Buckets are settled in order, all threads working on one at a time. The frontier's light
+edges (shorter than delta) are relaxed in parallel, over and over while they put vertices back into the same
+bucket; then each thread relaxes the heavy edges of the vertices it took from the bucket, which can only reach
+later buckets, and so only need relaxing once. Thread 0 gathers each frontier between barriers.
+*/
+
+void *deltaWorker(void *arg) {
+    struct delta_thread *t = arg;
+    struct delta_stepping *d = t->d;
+    struct graph *g = d->g;
+
+    while (1) {
+        pthread_barrier_wait(&d->barrier);
+        if (t->id == 0) {
+            nextBucket(d);
+        }
+        pthread_barrier_wait(&d->barrier);
+        if (d->done) {
+            break;
+        }
+
+        // Light edges, until no vertex comes back into the bucket
+        while (d->frontierSize > 0) {
+            int start;
+            while ((start = __atomic_fetch_add(&d->next, WORKCHUNK, __ATOMIC_RELAXED)) < d->frontierSize) {
+                int end = start + WORKCHUNK < d->frontierSize ? start + WORKCHUNK : d->frontierSize;
+                for (int i = start; i < end; i++) {
+                    int u = d->frontier[i];
+                    uint32_t dist = __atomic_load_n(&d->best[u], __ATOMIC_RELAXED) >> 32;
+                    pushVertex(&t->settled, &t->numSettled, &t->settledCap, u);
+                    for (uint32_t e = g->offsets[u]; e < g->offsets[u + 1]; e++) {
+                        if (g->weights[e] < d->delta) {
+                            relaxAtomic(t, u, g->targets[e], dist + g->weights[e]);
+                        }
+                    }
+                }
+            }
+            pthread_barrier_wait(&d->barrier);
+            if (t->id == 0) {
+                gatherBucket(d);
+            }
+            pthread_barrier_wait(&d->barrier);
+        }
+
+        // Heavy edges of everything settled in the bucket
+        for (int i = 0; i < t->numSettled; i++) {
+            int u = t->settled[i];
+            uint32_t dist = __atomic_load_n(&d->best[u], __ATOMIC_RELAXED) >> 32;
+            for (uint32_t e = g->offsets[u]; e < g->offsets[u + 1]; e++) {
+                if (g->weights[e] >= d->delta) {
+                    relaxAtomic(t, u, g->targets[e], dist + g->weights[e]);
+                }
+            }
+        }
+        t->numSettled = 0;
+    }
+    return NULL;
+}
+
+/* deltaStepping()
+Finds the shortest distance from source to every vertex, and each vertex's parent, like dijkstra(), but with
+delta-stepping on numThreads threads: vertices are settled a bucket of distances delta wide at a time rather than
+one by one, and the relaxations within a bucket run in parallel. Distances are the same as Dijkstra's Algorithm
+gives; where two shortest paths tie the parent may differ.
+*/
+
+int deltaStepping(struct graph *g, int source, int delta, int numThreads, int *distances, int *parent) {
+    int n = g->numNodes;
+    struct delta_stepping d;
+    memset(&d, 0, sizeof(d));
+    d.g = g;
+    d.delta = delta;
+    d.numThreads = numThreads;
+    d.bucket = -1;
+    int32_t longest = 0;
+    for (uint32_t e = 0; e < g->numArcs; e++) {
+        if (g->weights[e] > longest) {
+            longest = g->weights[e];
+        }
+    }
+    d.numBuckets = longest / delta + 2;
+    d.best = malloc(n * sizeof(uint64_t));
+    memset(d.best, 0xff, n * sizeof(uint64_t));
+    d.best[source] = 0xffffffffu;
+    d.frontier = malloc(n * sizeof(int));
+    d.queued = calloc(n, sizeof(uint32_t));
+    pthread_barrier_init(&d.barrier, NULL, numThreads);
+
+    d.threads = calloc(numThreads, sizeof(struct delta_thread));
+    for (int i = 0; i < numThreads; i++) {
+        d.threads[i].d = &d;
+        d.threads[i].id = i;
+        d.threads[i].buckets = calloc(d.numBuckets, sizeof(int *));
+        d.threads[i].sizes = calloc(d.numBuckets, sizeof(int));
+        d.threads[i].caps = calloc(d.numBuckets, sizeof(int));
+    }
+    pushVertex(&d.threads[0].buckets[0], &d.threads[0].sizes[0], &d.threads[0].caps[0], source);
+    for (int i = 0; i < numThreads; i++) {
+        if (pthread_create(&d.threads[i].thread, NULL, deltaWorker, &d.threads[i]) != 0) {
+            printf("Could not start delta-stepping thread %d\n", i);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(d.threads[i].thread, NULL);
+    }
+
+    for (int v = 0; v < n; v++) {
+        distances[v] = d.best[v] == UINT64_MAX ? INT_MAX : (int) (d.best[v] >> 32);
+        parent[v] = (uint32_t) d.best[v] == 0xffffffffu ? -1 : (int) (uint32_t) d.best[v];
+    }
+    for (int i = 0; i < numThreads; i++) {
+        for (int b = 0; b < d.numBuckets; b++) {
+            free(d.threads[i].buckets[b]);
+        }
+        free(d.threads[i].buckets);
+        free(d.threads[i].sizes);
+        free(d.threads[i].caps);
+        free(d.threads[i].settled);
+    }
+    free(d.threads);
+    free(d.best);
+    free(d.frontier);
+    free(d.queued);
+    pthread_barrier_destroy(&d.barrier);
+    return 0;
+}
+
+/* touch()
+Makes a vertex's heap position valid for the current repair the first time the repair touches it, and clears its
+mark.
+*/
+
+void touch(struct search *s, int v) {
+    if (s->stamp[v] != s->gen) {
+        s->stamp[v] = s->gen;
+        s->heap->pos[v] = -1;
+        s->dist[v] = 0;
+    }
+}
+
+/* repairTree()
+Repairs a shortest-path tree (dist and parent, over every vertex) after the road between a and b changed from
+oldLength to newLength (-1 for no road), touching only the part of the tree the change affects. A shorter or new
+road offers its ends a shorter way, and the improvement spreads outwards as in Dijkstra's Algorithm. A longer or
+closed road only matters if it is a tree edge: the subtree below it loses its distances, each of its vertices
+takes the best way in from a neighbour outside it, and Dijkstra's Algorithm settles the subtree from there. The
+search's arrays are scratch: its heap is keyed by the tree's distances, and a vertex touched by the repair has its
+dist set to 1 while it is in the lost subtree. Returns the number of vertices repaired.
+*/
+
+int repairTree(struct search *s, struct graph *g, int *dist, int *parent, int a, int b, int oldLength,
+               int newLength) {
+    struct heap *h = s->heap;
+    if (++s->gen == 0) {
+        memset(s->stamp, 0, g->numNodes * sizeof(uint32_t));
+        s->gen = 1;
+    }
+    h->size = 0;
+    h->keys = dist;
+    int repaired = 0;
+
+    if (newLength != -1 && (oldLength == -1 || newLength < oldLength)) {
+        int ends[2][2] = { {a, b}, {b, a} };
+        for (int e = 0; e < 2; e++) {
+            int u = ends[e][0];
+            int v = ends[e][1];
+            if (dist[u] != INT_MAX && dist[u] + newLength < dist[v]) {
+                touch(s, v);
+                dist[v] = dist[u] + newLength;
+                parent[v] = u;
+                heapPush(h, v);
+            }
+        }
+    } else if (oldLength != -1 && newLength != oldLength) {
+        int child = parent[b] == a ? b : parent[a] == b ? a : -1;
+        if (child == -1) {
+            return 0;
+        }
+
+        // Collect the subtree below the changed road, walking from each vertex to the neighbours it is parent of
+        int *lost = s->prio;
+        int numLost = 1;
+        lost[0] = child;
+        touch(s, child);
+        s->dist[child] = 1;
+        for (int i = 0; i < numLost; i++) {
+            int u = lost[i];
+            for (uint32_t e = g->offsets[u]; e < g->offsets[u + 1]; e++) {
+                int v = g->targets[e];
+                if (parent[v] == u) {
+                    touch(s, v);
+                    s->dist[v] = 1;
+                    lost[numLost++] = v;
+                }
+            }
+        }
+        for (int i = 0; i < numLost; i++) {
+            dist[lost[i]] = INT_MAX;
+            parent[lost[i]] = -1;
+        }
+
+        // Each lost vertex starts from its best neighbour outside the subtree, whose distance has not changed
+        for (int i = 0; i < numLost; i++) {
+            int v = lost[i];
+            for (uint32_t e = g->offsets[v]; e < g->offsets[v + 1]; e++) {
+                int u = g->targets[e];
+                if (!(s->stamp[u] == s->gen && s->dist[u] == 1) && dist[u] != INT_MAX &&
+                    dist[u] + g->weights[e] < dist[v]) {
+                    dist[v] = dist[u] + g->weights[e];
+                    parent[v] = u;
+                }
+            }
+            if (dist[v] != INT_MAX) {
+                heapPush(h, v);
+            }
+        }
+        repaired = numLost;
+    }
+
+    // Spread the new distances
+    while (h->size > 0) {
+        int u = heapPop(h);
+        repaired += s->stamp[u] != s->gen || s->dist[u] != 1;
+        for (uint32_t e = g->offsets[u]; e < g->offsets[u + 1]; e++) {
+            int v = g->targets[e];
+            if (dist[u] + g->weights[e] < dist[v]) {
+                touch(s, v);
+                dist[v] = dist[u] + g->weights[e];
+                parent[v] = u;
+                heapPush(h, v);
+            }
+        }
+    }
+    return repaired;
+}
+
+/* lowerLandmarks()
+Keeps the landmark bounds safe after the road between a and b became shorter or new. The bounds stay below the
+true distances (and A* stays exact) as long as no road is shorter than the difference of its ends' landmark
+distances; longer roads keep that true, so only a shorter road needs anything done. For each landmark it lowers
+the distance of an end the road now reaches more cheaply, and spreads that as in Dijkstra's Algorithm, with the
+search's prio array holding the heap keys.
+*/
+
+int lowerLandmarks(struct search *s, struct graph *g, int a, int b, int length) {
+    int L = g->numLandmarks;
+    struct heap *h = s->heap;
+    h->keys = s->prio;
+
+    for (int l = 0; l < L; l++) {
+        int32_t *D = g->landmarkDist + l;
+        if (++s->gen == 0) {
+            memset(s->stamp, 0, g->numNodes * sizeof(uint32_t));
+            s->gen = 1;
+        }
+        h->size = 0;
+        int ends[2][2] = { {a, b}, {b, a} };
+        for (int e = 0; e < 2; e++) {
+            int u = ends[e][0];
+            int v = ends[e][1];
+            if (D[(long) u * L] != INT_MAX && D[(long) u * L] + length < D[(long) v * L]) {
+                D[(long) v * L] = D[(long) u * L] + length;
+                touch(s, v);
+                s->prio[v] = D[(long) v * L];
+                heapPush(h, v);
+            }
+        }
+        while (h->size > 0) {
+            int u = heapPop(h);
+            for (uint32_t e = g->offsets[u]; e < g->offsets[u + 1]; e++) {
+                int v = g->targets[e];
+                if (D[(long) u * L] + g->weights[e] < D[(long) v * L]) {
+                    D[(long) v * L] = D[(long) u * L] + g->weights[e];
+                    touch(s, v);
+                    s->prio[v] = D[(long) v * L];
+                    heapPush(h, v);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/* viewDist()
+Returns a vertex's distance in a tree view, INT_MAX if it was not reached.
+*/
+
+int viewDist(struct tree_view *t, int v) {
+    return t->stamp == NULL || t->stamp[v] == t->gen ? t->dist[v] : INT_MAX;
+}
+
+/* viewParent()
+Returns a vertex's parent in a tree view, -1 if it has none.
+*/
+
+int viewParent(struct tree_view *t, int v) {
+    return t->stamp == NULL || t->stamp[v] == t->gen ? t->parent[v] : -1;
+}
+
+/* dijkstra()
+Finds the shortest distance from source to every vertex of the graph, and the parent of each vertex on its
+shortest path (-1 for the source and unreachable vertices, whose distance stays INT_MAX).
+*/
+
+int dijkstra(struct graph *g, int source, int *distances, int *parent) {
+    struct search s;
+    initSearch(&s, g->numNodes);
+    searchFrom(&s, g, source, -1);
+    struct tree_view t = { s.dist, s.parent, s.stamp, s.gen };
+    for (int q = 0; q < g->numNodes; q++) {
+        distances[q] = viewDist(&t, q);
+        parent[q] = viewParent(&t, q);
+    }
+    freeSearch(&s);
+    return 0;
+}
+
+/* chooseLandmarks()
+Chooses count landmarks by farthest-point selection, each the city farthest from those already chosen (the first
+the city farthest from the map's first city), which spreads them around the edges of the map where their bounds
+are tightest. Records every city's distance to each. Cities no landmark reaches count as farthest, so each part
+of a disconnected map gets a landmark while there are enough.
+*/
+
+int chooseLandmarks(struct graph *g, int count) {
+    int n = g->numNodes;
+    if (count > n) {
+        count = n;
+    }
+    if (count > MAXLANDMARKS) {
+        count = MAXLANDMARKS;
+    }
+    g->numLandmarks = count;
+    g->landmarks = malloc(count * sizeof(uint32_t));
+    g->landmarkDist = malloc((long) n * count * sizeof(int32_t));
+    if (count == 0) {
+        return 0;
+    }
+
+    int *closest = malloc(n * sizeof(int));
+    struct search s;
+    initSearch(&s, n);
+    searchFrom(&s, g, cityAt(g, 0), -1);
+    struct tree_view t = { s.dist, s.parent, s.stamp, s.gen };
+    for (int v = 0; v < n; v++) {
+        closest[v] = viewDist(&t, v);
+    }
+
+    for (int l = 0; l < count; l++) {
+        int far = 0;
+        for (int v = 1; v < n; v++) {
+            if (closest[v] > closest[far]) {
+                far = v;
+            }
+        }
+        g->landmarks[l] = far;
+        searchFrom(&s, g, far, -1);
+        t.gen = s.gen;
+        for (int v = 0; v < n; v++) {
+            int d = viewDist(&t, v);
+            g->landmarkDist[(long) v * count + l] = d;
+            if (l == 0 || d < closest[v]) {
+                closest[v] = d;
+            }
+        }
+    }
+    free(closest);
+    freeSearch(&s);
+    return 0;
+}
+
+/* writeAll()
+Writes a whole buffer to a file descriptor.
+*/
+
+int writeAll(int fd, const void *data, size_t len) {
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = write(fd, (const char *) data + done, len - done);
+        if (n <= 0) {
+            printf("Could not write the output\n");
+            exit(1);
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/* flushWriter()
+Writes out everything gathered by a writer, after anything printf() still holds for standard output.
+*/
+
+int flushWriter(struct writer *w) {
+    fflush(stdout);
+    writeAll(w->fd, w->buf, w->used);
+    w->used = 0;
+    return 0;
+}
+
+/* writeText()
+Adds len bytes of text to a writer, writing its buffer out when it fills.
+*/
+
+int writeText(struct writer *w, const char *text, size_t len) {
+    if (w->used + len > WRITEBUF) {
+        flushWriter(w);
+        if (len > WRITEBUF) {
+            return writeAll(w->fd, text, len);
+        }
+    }
+    memcpy(w->buf + w->used, text, len);
+    w->used += len;
+    return 0;
+}
+
+/* writeString()
+Adds a string to a writer.
+*/
+
+int writeString(struct writer *w, const char *text) {
+    return writeText(w, text, strlen(text));
+}
+
+/* writeNumber()
+Adds a number to a writer, right-aligned in width characters like printf's "%*d" but without parsing a format
+for every number.
+*/
+
+int writeNumber(struct writer *w, int value, int width) {
+    char digits[12];
+    int n = 0;
+    unsigned int u = value < 0 ? -(unsigned int) value : (unsigned int) value;
+    do {
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    if (value < 0) {
+        digits[n++] = '-';
+    }
+
+    char text[32];
+    int len = 0;
+    for (; width > n && len < 16; width--) {
+        text[len++] = ' ';
+    }
+    while (n > 0) {
+        text[len++] = digits[--n];
+    }
+    return writeText(w, text, len);
+}
+
+/* findPathToDest()
+Writes the path to dest in the form "XXX-->XXX-->XXX". The parent array is walked once from dest back to the
+source (the city whose parent is -1), collecting the cities in nodes, which must have room for every city; the
+names are then written from the far end of nodes. Returns the number of cities on the path.
+*/
+
+int findPathToDest(struct writer *out, int *nodes, int *parent, int dest, struct graph *g) {
+    int n = 0;
+    for (int v = dest; v != -1; v = parent[v]) {
+        nodes[n++] = v;
+    }
+    for (int i = n - 1; i >= 0; i--) {
+        if (i < n - 1) {
+            writeText(out, "-->", 3);
+        }
+        writeString(out, cityName(g, nodes[i]));
+    }
+    return n;
+}
+
+
+struct graph Graph;                 // the server's graph, shared read-only by the workers
+struct name_table Names;
+struct tree_cache Trees;
+pthread_rwlock_t GraphLock;         // held for reading by queries and for writing by road changes
+
+/* addReply()
+Appends formatted text to a reply, growing it as needed.
+*/
+
+int addReply(struct reply *r, const char *format, ...) {
+    va_list args;
+    while (1) {
+        va_start(args, format);
+        int n = vsnprintf(r->data + r->len, r->cap - r->len, format, args);
+        va_end(args);
+        if (r->len + n < r->cap) {
+            r->len += n;
+            return n;
+        }
+        r->cap = 2 * (r->len + n + 1);
+        r->data = realloc(r->data, r->cap);
+    }
+}
+
+/* findTree()
+Returns the cached tree of a source with a reference held, or NULL if it is not cached.
+*/
+
+struct tree *findTree(int source) {
+    struct tree *found = NULL;
+    pthread_mutex_lock(&Trees.lock);
+    for (int i = 0; i < TREECACHE; i++) {
+        if (Trees.trees[i].source == source) {
+            found = &Trees.trees[i];
+            found->refs++;
+            found->lastUsed = ++Trees.clock;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&Trees.lock);
+    return found;
+}
+
+/* releaseTree()
+Drops a reference taken by findTree() or cacheTree().
+*/
+
+int releaseTree(struct tree *t) {
+    pthread_mutex_lock(&Trees.lock);
+    t->refs--;
+    pthread_mutex_unlock(&Trees.lock);
+    return 0;
+}
+
+/* cacheTree()
+Copies the whole tree just computed by a worker's search into the cache, replacing the least recently used tree
+nobody is reading. Returns it with a reference held, or NULL if every cached tree is in use.
+*/
+
+struct tree *cacheTree(struct search *s, int source) {
+    struct tree *victim = NULL;
+    pthread_mutex_lock(&Trees.lock);
+    for (int i = 0; i < TREECACHE; i++) {
+        struct tree *t = &Trees.trees[i];
+        if (t->refs == 0 && (victim == NULL || t->lastUsed < victim->lastUsed)) {
+            victim = t;
+        }
+    }
+    if (victim != NULL) {
+        victim->source = -1;
+        victim->refs = 1;
+        victim->lastUsed = ++Trees.clock;
+    }
+    pthread_mutex_unlock(&Trees.lock);
+    if (victim == NULL) {
+        return NULL;
+    }
+
+    if (victim->dist == NULL) {
+        victim->dist = malloc(Graph.numNodes * sizeof(int));
+        victim->parent = malloc(Graph.numNodes * sizeof(int));
+    }
+    struct tree_view view = { s->dist, s->parent, s->stamp, s->gen };
+    for (int v = 0; v < Graph.numNodes; v++) {
+        victim->dist[v] = viewDist(&view, v);
+        victim->parent[v] = viewParent(&view, v);
+    }
+
+    pthread_mutex_lock(&Trees.lock);
+    victim->source = source;
+    pthread_mutex_unlock(&Trees.lock);
+    return victim;
+}
+
+/* isHot()
+Counts a route query from a source and returns 1 once HOTAFTER have been made from it, so its whole tree is worth
+computing and caching. Sources sharing a slot displace each other's counts.
+*/
+
+int isHot(int source) {
+    int slot = hashName((char *) &source, sizeof(source)) & (HOTSLOTS - 1);
+    pthread_mutex_lock(&Trees.lock);
+    if (Trees.hotSource[slot] != source) {
+        Trees.hotSource[slot] = source;
+        Trees.hotCount[slot] = 0;
+    }
+    int hot = ++Trees.hotCount[slot] >= HOTAFTER;
+    pthread_mutex_unlock(&Trees.lock);
+    return hot;
+}
+
+/* parseChange()
+Parses a road change, "set SRC DST LENGTH" or "close SRC DST", into its two cities and the road's new length (-1
+for a closed road). Returns NULL, or what is wrong with the line.
+*/
+
+const char *parseChange(char *line, int *a, int *b, int *length) {
+    char command[16], src[LINELEN], dst[LINELEN];
+    int fields = sscanf(line, "%15s %255s %255s %d", command, src, dst, length);
+    if (fields == 3 && strcmp(command, "close") == 0) {
+        *length = -1;
+    } else if (fields != 4 || strcmp(command, "set") != 0 || *length < 0) {
+        return "expected \"set SRC DST LENGTH\" or \"close SRC DST\"";
+    }
+    *a = findCity(&Graph, &Names, src, strlen(src));
+    *b = findCity(&Graph, &Names, dst, strlen(dst));
+    if (*a == -1 || *b == -1) {
+        return "unknown city";
+    }
+    if (*a == *b) {
+        return "a road joins two different cities";
+    }
+    return NULL;
+}
+
+/* changeRoad()
+Answers a road change (see parseChange()) with "ok <cities repaired>". With queries locked out it changes the
+graph, repairs every cached tree and lowers the landmark distances if the road got shorter. Shortcut lengths in
+a contraction hierarchy are not repaired, so a changed map stops using its hierarchy.
+*/
+
+int changeRoad(struct worker *w, char *line, struct reply *r) {
+    int a, b, length;
+    const char *error = parseChange(line, &a, &b, &length);
+    if (error != NULL) {
+        return addReply(r, "error %s\n", error);
+    }
+
+    pthread_rwlock_wrlock(&GraphLock);
+    int old = setRoad(&Graph, a, b, length);
+    int repaired = 0;
+    if (old != length) {
+        Graph.ranks = NULL;
+        if (length != -1 && (old == -1 || length < old)) {
+            lowerLandmarks(&w->search, &Graph, a, b, length);
+        }
+        for (int i = 0; i < TREECACHE; i++) {
+            struct tree *t = &Trees.trees[i];
+            if (t->source != -1) {
+                repaired += repairTree(&w->search, &Graph, t->dist, t->parent, a, b, old, length);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&GraphLock);
+    return addReply(r, "ok %d\n", repaired);
+}
+
+/* treePath()
+Stores the path from the root of a tree to dest in nodes, collected walking the parents back from dest and then
+turned around, and returns the number of vertices on it.
+*/
+
+int treePath(struct tree_view *t, int dest, int *nodes) {
+    int n = 0;
+    for (int v = dest; v != -1; v = viewParent(t, v)) {
+        nodes[n++] = v;
+    }
+    for (int i = 0; i < n / 2; i++) {
+        int v = nodes[i];
+        nodes[i] = nodes[n - 1 - i];
+        nodes[n - 1 - i] = v;
+    }
+    return n;
+}
+
+/* findRoute()
+Finds a shortest route from source to target with the given search (ONEWAY, BIDIRECTIONAL, ALT or HIERARCHY)
+and stores its vertices in the worker's pathNodes. Returns the number of vertices on it, with its length in dist,
+or 0 if there is no route. A bidirectional route is the path to the meeting point followed by the backward
+search's parents from there on to the target; in a hierarchy that route is made of arcs that are unpacked.
+*/
+
+int findRoute(struct worker *w, int method, int source, int target, int *dist) {
+    struct search *s = &w->search;
+    if (method == BIDIRECTIONAL || method == HIERARCHY) {
+        int meet = method == HIERARCHY ? searchHierarchy(s, &w->back, &Graph, source, target)
+                                       : searchBetween(s, &w->back, &Graph, source, target);
+        if (meet == -1) {
+            return 0;
+        }
+        *dist = s->dist[meet] + w->back.dist[meet];
+        int *hops = method == HIERARCHY ? w->hops : w->pathNodes;
+        struct tree_view t = { s->dist, s->parent, s->stamp, s->gen };
+        int n = treePath(&t, meet, hops);
+        for (int v = w->back.parent[meet]; v != -1; v = w->back.parent[v]) {
+            hops[n++] = v;
+        }
+        if (method == BIDIRECTIONAL) {
+            return n;
+        }
+        int count = 1;
+        w->pathNodes[0] = source;
+        for (int i = 1; i < n; i++) {
+            count = unpackArc(&Graph, hops[i - 1], hops[i], w->pathNodes, count);
+        }
+        return count;
+    }
+
+    if (method == ALT) {
+        searchAlt(s, &Graph, source, target);
+    } else {
+        searchFrom(s, &Graph, source, target);
+    }
+    struct tree_view t = { s->dist, s->parent, s->stamp, s->gen };
+    *dist = viewDist(&t, target);
+    return *dist == INT_MAX ? 0 : treePath(&t, target, w->pathNodes);
+}
+
+/* searchNamed()
+Returns the search a route query names ("dijkstra", "bidir", "alt" or "ch"), or -1 for any other name or for a
+hierarchy search on a map compiled without one. A map whose hierarchy a road change took away still accepts
+"ch", and answers it with an ALT search.
+*/
+
+int searchNamed(char *name) {
+    char *names[] = {"dijkstra", "bidir", "alt", "ch"};
+    for (int m = ONEWAY; m <= HIERARCHY; m++) {
+        if (m == HIERARCHY && Graph.numUpArcs == 0) {
+            continue;
+        }
+        if (strcmp(name, names[m]) == 0) {
+            return m;
+        }
+    }
+    return -1;
+}
+
+/* addPath()
+Appends a path in the form "XXX-->XXX-->XXX" to a reply.
+*/
+
+int addPath(struct reply *r, int *nodes, int n) {
+    for (int i = 0; i < n; i++) {
+        addReply(r, i == 0 ? "%s" : "-->%s", cityName(&Graph, nodes[i]));
+    }
+    return 0;
+}
+
+/* answerQuery()
+Answers one query line: "route SRC DST" with "<distance> <path>" (or "no route"), and "tree SRC" with a
+"<city> <distance> <parent>" line for every city reachable from SRC followed by "end". A route from a source
+with a cached tree is read off the tree, and once a source is hot its whole tree is computed and cached; other
+routes are found in the contraction hierarchy if the map has one, and with an A* search over the landmark bounds
+if not. "route SRC DST dijkstra|bidir|alt|ch" skips the cache and uses the named search. Road changes are
+handed to changeRoad().
+*/
+
+int answerQuery(struct worker *w, char *line, struct reply *r) {
+    char command[16], src[LINELEN], dst[LINELEN], how[16];
+    if (strncmp(line, "set ", 4) == 0 || strncmp(line, "close ", 6) == 0) {
+        return changeRoad(w, line, r);
+    }
+    int fields = sscanf(line, "%15s %255s %255s %15s", command, src, dst, how);
+    int source = fields >= 2 ? findCity(&Graph, &Names, src, strlen(src)) : -1;
+    int target = fields >= 3 ? findCity(&Graph, &Names, dst, strlen(dst)) : -1;
+    int method = fields == 4 ? searchNamed(how) : Graph.ranks != NULL ? HIERARCHY : ALT;
+
+    int isRoute = (fields == 3 || fields == 4) && method != -1 && strcmp(command, "route") == 0;
+    int isTree = fields == 2 && strcmp(command, "tree") == 0;
+    if (!isRoute && !isTree) {
+        return addReply(r, "error expected \"route SRC DST [dijkstra|bidir|alt|ch]\" or \"tree SRC\"\n");
+    }
+    if (source == -1 || (isRoute && target == -1)) {
+        return addReply(r, "error unknown city %s\n", source == -1 ? src : dst);
+    }
+    pthread_rwlock_rdlock(&GraphLock);
+    if (method == HIERARCHY && Graph.ranks == NULL) {
+        method = ALT;       // a road change took the hierarchy away
+    }
+
+    struct search *s = &w->search;
+    struct tree *cached = fields <= 3 ? findTree(source) : NULL;
+    int whole = cached != NULL;
+    if (cached == NULL && (isTree || (fields == 3 && isHot(source)))) {
+        searchFrom(s, &Graph, source, -1);
+        cached = cacheTree(s, source);
+        whole = 1;
+    }
+    struct tree_view t = { s->dist, s->parent, s->stamp, s->gen };
+    if (cached != NULL) {
+        t = (struct tree_view) { cached->dist, cached->parent, NULL, 0 };
+    }
+
+    if (isRoute) {
+        int dist = INT_MAX;
+        int n = 0;
+        if (!whole) {
+            n = findRoute(w, method, source, target, &dist);
+        } else if ((dist = viewDist(&t, target)) != INT_MAX) {
+            n = treePath(&t, target, w->pathNodes);
+        }
+        if (n == 0) {
+            addReply(r, "no route\n");
+        } else {
+            addReply(r, "%d ", dist);
+            addPath(r, w->pathNodes, n);
+            addReply(r, "\n");
+        }
+    } else {
+        for (int i = 0; i < Graph.numNodes; i++) {
+            int v = cityAt(&Graph, i);
+            int d = viewDist(&t, v);
+            if (d != INT_MAX) {
+                int p = viewParent(&t, v);
+                addReply(r, "%s %d %s\n", cityName(&Graph, v), d, p == -1 ? "-" : cityName(&Graph, p));
+            }
+        }
+        addReply(r, "end\n");
+    }
+
+    if (cached != NULL) {
+        releaseTree(cached);
+    }
+    pthread_rwlock_unlock(&GraphLock);
+    return 0;
+}
+
+/* serveClient()
+Answers the query lines of one connection until the client closes it. All replies to the lines that arrived
+together are sent with one write.
+*/
+
+int serveClient(struct worker *w, int fd) {
+    char buf[4 * LINELEN];
+    size_t have = 0;
+    struct reply r = { malloc(4096), 0, 4096 };
+
+    while (1) {
+        ssize_t n = recv(fd, buf + have, sizeof(buf) - have, 0);
+        if (n <= 0) {
+            break;
+        }
+        have += n;
+
+        // Answer every complete line
+        char *start = buf;
+        char *nl;
+        r.len = 0;
+        while ((nl = memchr(start, '\n', buf + have - start)) != NULL) {
+            *nl = '\0';
+            if (nl > start && nl[-1] == '\r') {
+                nl[-1] = '\0';
+            }
+            answerQuery(w, start, &r);
+            start = nl + 1;
+        }
+        have -= start - buf;
+        memmove(buf, start, have);
+        if (have == sizeof(buf)) {
+            addReply(&r, "error line too long\n");
+            have = 0;
+        }
+
+        for (size_t sent = 0; sent < r.len; ) {
+            ssize_t m = send(fd, r.data + sent, r.len - sent, MSG_NOSIGNAL);
+            if (m <= 0) {
+                free(r.data);
+                return -1;
+            }
+            sent += m;
+        }
+    }
+    free(r.data);
+    return 0;
+}
+
+/* serverWorker()
+Worker thread. Takes connections from the listening sockets one at a time and serves each until it closes.
+*/
+
+void *serverWorker(void *arg) {
+    struct worker *w = arg;
+    struct pollfd *fds = w->listeners;
+    int one = 1;
+
+    while (1) {
+        if (poll(fds, 2, -1) <= 0) {
+            continue;
+        }
+        for (int f = 0; f < 2; f++) {
+            if (!(fds[f].revents & POLLIN)) {
+                continue;
+            }
+            int fd = accept(fds[f].fd, NULL, NULL);
+            if (fd == -1) {
+                continue;
+            }
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            serveClient(w, fd);
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+/* listenOn()
+Creates a listening socket, non-blocking so that workers woken for the same connection do not wait in accept().
+With a path it is a Unix-domain stream socket; otherwise TCP on the given port.
+*/
+
+int listenOn(int port, char *path) {
+    int fd;
+    int one = 1;
+    if (path != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            printf("Socket path %s is too long\n", path);
+            exit(1);
+        }
+        strcpy(addr.sun_path, path);
+        unlink(path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+            printf("Could not bind %s\n", path);
+            exit(1);
+        }
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd == -1 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+            printf("Could not bind port %d\n", port);
+            exit(1);
+        }
+    }
+    if (listen(fd, 128) == -1) {
+        printf("Listen() call failed\n");
+        exit(1);
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/* startGraph()
+Loads the graph for route queries, with its cities indexed by name. A map compiled without landmarks (or a text
+map) has them chosen now.
+*/
+
+int startGraph(char *path) {
+    loadGraph(&Graph, path);
+    indexCities(&Graph, &Names);
+    if (Graph.numLandmarks == 0) {
+        chooseLandmarks(&Graph, NUMLANDMARKS);
+    }
+    return 0;
+}
+
+/* initWorker()
+Allocates a worker's search state.
+*/
+
+int initWorker(struct worker *w) {
+    initSearch(&w->search, Graph.numNodes);
+    initSearch(&w->back, Graph.numNodes);
+    w->pathNodes = malloc(Graph.numNodes * sizeof(int));
+    w->hops = malloc(Graph.numNodes * sizeof(int));
+    return 0;
+}
+
+/* serve()
+Server mode: "dijkstra-routing serve [-p port] [-u socket path] [-w workers] <map>". Loads the graph once and
+answers route and tree queries (see answerQuery()) on TCP and, with -u, a Unix-domain socket.
+*/
+
+int serve(int argc, char *argv[]) {
+    int opt;
+    int port = ROUTEPORT;
+    char *unixPath = NULL;
+    int numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "p:u:w:")) != -1) {
+        if (opt == 'p') {
+            port = atoi(optarg);
+        } else if (opt == 'u') {
+            unixPath = optarg;
+        } else if (opt == 'w') {
+            numWorkers = atoi(optarg);
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        printf("Usage: dijkstra-routing serve [-p port] [-u socket path] [-w workers] <map>\n");
+        exit(1);
+    }
+    if (numWorkers < 1) {
+        numWorkers = 1;
+    } else if (numWorkers > MAXWORKERS) {
+        numWorkers = MAXWORKERS;
+    }
+
+    startGraph(argv[optind]);
+    pthread_mutex_init(&Trees.lock, NULL);
+    pthread_rwlockattr_t writerFirst;
+    pthread_rwlockattr_init(&writerFirst);
+    pthread_rwlockattr_setkind_np(&writerFirst, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&GraphLock, &writerFirst);
+    for (int i = 0; i < TREECACHE; i++) {
+        Trees.trees[i].source = -1;
+    }
+    for (int i = 0; i < HOTSLOTS; i++) {
+        Trees.hotSource[i] = -1;
+    }
+
+    static struct pollfd listeners[2];
+    listeners[0] = (struct pollfd) { .fd = listenOn(port, NULL), .events = POLLIN };
+    listeners[1] = (struct pollfd) { .fd = unixPath != NULL ? listenOn(0, unixPath) : -1, .events = POLLIN };
+
+    static struct worker workers[MAXWORKERS];
+    for (int i = 0; i < numWorkers; i++) {
+        initWorker(&workers[i]);
+        workers[i].listeners = listeners;
+        if (pthread_create(&workers[i].thread, NULL, serverWorker, &workers[i]) != 0) {
+            printf("Could not start worker %d\n", i);
+            exit(1);
+        }
+    }
+    printf("Serving routes over %d cities on port %d with %d workers\n", Graph.numNodes, port, numWorkers);
+    fflush(stdout);
+
+    for (int i = 0; i < numWorkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    return 0;
+}
+
+/* batchWorker()
+Batch thread. Takes the next source, runs a whole search from it and formats its row of distances, then waits
+for the rows before it to be written and writes its own, so the threads keep searching while rows come out in
+order.
+*/
+
+void *batchWorker(void *arg) {
+    struct batch_worker *w = arg;
+    struct batch *b = w->b;
+    struct search *s = &w->search;
+
+    while (1) {
+        int i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+        if (i >= b->numSources) {
+            break;
+        }
+        searchFrom(s, &Graph, b->sources[i], -1);
+        struct tree_view t = { s->dist, s->parent, s->stamp, s->gen };
+
+        w->row.len = 0;
+        if (b->format == BINARY) {
+            int32_t *row = (int32_t *) w->row.data;
+            for (int c = 0; c < Graph.numNodes; c++) {
+                int d = viewDist(&t, cityAt(&Graph, c));
+                row[c] = d == INT_MAX ? -1 : d;
+            }
+            w->row.len = Graph.numNodes * sizeof(int32_t);
+        } else {
+            addReply(&w->row, "%s", cityName(&Graph, b->sources[i]));
+            for (int c = 0; c < Graph.numNodes; c++) {
+                int d = viewDist(&t, cityAt(&Graph, c));
+                addReply(&w->row, d == INT_MAX ? "," : ",%d", d);
+            }
+            addReply(&w->row, "\n");
+        }
+
+        pthread_mutex_lock(&b->lock);
+        while (b->written != i) {
+            pthread_cond_wait(&b->turn, &b->lock);
+        }
+        pthread_mutex_unlock(&b->lock);
+        writeAll(b->fd, w->row.data, w->row.len);
+        pthread_mutex_lock(&b->lock);
+        b->written++;
+        pthread_cond_broadcast(&b->turn);
+        pthread_mutex_unlock(&b->lock);
+    }
+    return NULL;
+}
+
+/* batch()
+"dijkstra-routing batch [-s sources] [-b] [-o output] [-t threads] <map>": writes the shortest distance from each
+source (every city, unless -s names a file of city names) to every city. The searches are independent, so each
+thread runs its own over the shared read-only graph with its own heap and scratch arrays. The matrix is CSV (a
+header of city names, then a row per source led by its name, unreachable cities left empty), or with -b binary:
+a matrix_header, the source indices and a row of int32 distances per source.
+*/
+
+int batch(int argc, char *argv[]) {
+    int opt;
+    char *sourcePath = NULL;
+    char *outPath = NULL;
+    int numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct batch b = { .format = CSV, .fd = 1 };
+
+    while ((opt = getopt(argc, argv, "s:bo:t:")) != -1) {
+        if (opt == 's') {
+            sourcePath = optarg;
+        } else if (opt == 'b') {
+            b.format = BINARY;
+        } else if (opt == 'o') {
+            outPath = optarg;
+        } else if (opt == 't') {
+            numThreads = atoi(optarg);
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        printf("Usage: dijkstra-routing batch [-s sources] [-b] [-o output] [-t threads] <map>\n");
+        exit(1);
+    }
+    if (numThreads < 1) {
+        numThreads = 1;
+    } else if (numThreads > MAXTHREADS) {
+        numThreads = MAXTHREADS;
+    }
+    loadGraph(&Graph, argv[optind]);
+    indexCities(&Graph, &Names);
+
+    // The sources: every city, or those named in the sources file
+    int capacity = Graph.numNodes + 1;
+    b.sources = malloc(capacity * sizeof(int));
+    if (sourcePath == NULL) {
+        for (int i = 0; i < Graph.numNodes; i++) {
+            b.sources[b.numSources++] = cityAt(&Graph, i);
+        }
+    } else {
+        size_t len;
+        char *data = mapFile(sourcePath, &len);
+        for (char *p = data, *end = data + len; p < end; ) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+                p++;
+            }
+            char *name = p;
+            while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+                p++;
+            }
+            if (p == name) {
+                break;
+            }
+            int v = findCity(&Graph, &Names, name, p - name);
+            if (v == -1) {
+                printf("Unknown city %.*s\n", (int) (p - name), name);
+                exit(1);
+            }
+            if (b.numSources == capacity) {
+                capacity *= 2;
+                b.sources = realloc(b.sources, capacity * sizeof(int));
+            }
+            b.sources[b.numSources++] = v;
+        }
+    }
+
+    if (outPath != NULL) {
+        b.fd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (b.fd == -1) {
+            printf("Could not create %s\n", outPath);
+            exit(1);
+        }
+    }
+    if (b.format == BINARY) {
+        struct matrix_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MATRIXMAGIC, sizeof(MATRIXMAGIC));
+        header.numSources = b.numSources;
+        header.numNodes = Graph.numNodes;
+        writeAll(b.fd, &header, sizeof(header));
+        int *positions = malloc(b.numSources * sizeof(int));
+        for (int i = 0; i < b.numSources; i++) {
+            positions[i] = positionOf(&Graph, b.sources[i]);
+        }
+        writeAll(b.fd, positions, b.numSources * sizeof(int));
+        free(positions);
+    } else {
+        struct reply r = { malloc(4096), 0, 4096 };
+        addReply(&r, "source");
+        for (int i = 0; i < Graph.numNodes; i++) {
+            addReply(&r, ",%s", cityName(&Graph, cityAt(&Graph, i)));
+        }
+        addReply(&r, "\n");
+        writeAll(b.fd, r.data, r.len);
+        free(r.data);
+    }
+
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.turn, NULL);
+    struct batch_worker *workers = calloc(numThreads, sizeof(struct batch_worker));
+    for (int i = 0; i < numThreads; i++) {
+        workers[i].b = &b;
+        initSearch(&workers[i].search, Graph.numNodes);
+        workers[i].row.cap = Graph.numNodes * sizeof(int32_t) + 64;
+        workers[i].row.data = malloc(workers[i].row.cap);
+        if (pthread_create(&workers[i].thread, NULL, batchWorker, &workers[i]) != 0) {
+            printf("Could not start batch thread %d\n", i);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (b.fd != 1 && close(b.fd) == -1) {
+        printf("Could not write %s\n", outPath);
+        exit(1);
+    }
+    return 0;
+}
+
+/* millisSince()
+Returns the milliseconds elapsed since start on the monotonic clock.
+*/
+
+double millisSince(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* singleSource()
+"dijkstra-routing sssp [-d delta] [-t threads] [-q] [-v] <map> [SRC]": finds the shortest-path tree from SRC (the
+first city by default) with delta-stepping, and prints a "<city> <distance> <parent>" line for every city reached
+unless -q is given, then how long it took. Delta defaults to the average road length. With -v the tree is checked
+against Dijkstra's Algorithm: every distance must be the same and every parent one road shorter.
+*/
+
+int singleSource(int argc, char *argv[]) {
+    int opt;
+    int delta = 0;
+    int numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int quiet = 0;
+    int verify = 0;
+
+    while ((opt = getopt(argc, argv, "d:t:qv")) != -1) {
+        if (opt == 'd') {
+            delta = atoi(optarg);
+        } else if (opt == 't') {
+            numThreads = atoi(optarg);
+        } else if (opt == 'q') {
+            quiet = 1;
+        } else if (opt == 'v') {
+            verify = 1;
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        printf("Usage: dijkstra-routing sssp [-d delta] [-t threads] [-q] [-v] <map> [SRC]\n");
+        exit(1);
+    }
+    if (numThreads < 1) {
+        numThreads = 1;
+    } else if (numThreads > MAXTHREADS) {
+        numThreads = MAXTHREADS;
+    }
+    loadGraph(&Graph, argv[optind]);
+    indexCities(&Graph, &Names);
+    if (Graph.numNodes == 0) {
+        printf("No edges in the input\n");
+        exit(1);
+    }
+    int source = cityAt(&Graph, 0);
+    if (optind == argc - 2) {
+        source = findCity(&Graph, &Names, argv[argc - 1], strlen(argv[argc - 1]));
+        if (source == -1) {
+            printf("Unknown city %s\n", argv[argc - 1]);
+            exit(1);
+        }
+    }
+    if (delta < 1) {
+        long total = 0;
+        for (uint32_t e = 0; e < Graph.numArcs; e++) {
+            total += Graph.weights[e];
+        }
+        delta = Graph.numArcs > 0 && total / Graph.numArcs > 0 ? total / Graph.numArcs : 1;
+    }
+
+    int V = Graph.numNodes;
+    int *distances = malloc(V * sizeof(int));
+    int *parent = malloc(V * sizeof(int));
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deltaStepping(&Graph, source, delta, numThreads, distances, parent);
+    double took = millisSince(&start);
+
+    int reached = 0;
+    struct writer *out = malloc(sizeof(struct writer));
+    out->fd = STDOUT_FILENO;
+    out->used = 0;
+    for (int i = 0; i < V; i++) {
+        int v = cityAt(&Graph, i);
+        if (distances[v] == INT_MAX) {
+            continue;
+        }
+        reached++;
+        if (!quiet) {
+            writeString(out, cityName(&Graph, v));
+            writeText(out, " ", 1);
+            writeNumber(out, distances[v], 0);
+            writeText(out, " ", 1);
+            writeString(out, parent[v] == -1 ? "-" : cityName(&Graph, parent[v]));
+            writeText(out, "\n", 1);
+        }
+    }
+    flushWriter(out);
+    printf("Reached %d cities from %s in %.3f ms (delta %d, %d threads)\n", reached, cityName(&Graph, source), took,
+           delta, numThreads);
+
+    if (verify) {
+        int *expected = malloc(V * sizeof(int));
+        int *expectedParent = malloc(V * sizeof(int));
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        dijkstra(&Graph, source, expected, expectedParent);
+        took = millisSince(&start);
+
+        int wrong = 0;
+        for (int v = 0; v < V; v++) {
+            int ok = distances[v] == expected[v];
+            if (ok && parent[v] != -1) {
+                ok = 0;
+                for (uint32_t e = Graph.offsets[parent[v]]; e < Graph.offsets[parent[v] + 1]; e++) {
+                    if ((int) Graph.targets[e] == v && distances[parent[v]] + Graph.weights[e] == distances[v]) {
+                        ok = 1;
+                    }
+                }
+            } else if (ok) {
+                ok = v == source || distances[v] == INT_MAX;
+            }
+            wrong += !ok;
+        }
+        printf("Dijkstra's Algorithm took %.3f ms; %d cities differ\n", took, wrong);
+        if (wrong > 0) {
+            exit(1);
+        }
+    }
+    return 0;
+}
+
+/* updateTree()
+"dijkstra-routing update [-v] <map> <changes> [SRC]": finds the shortest-path tree from SRC (the first city by
+default), then applies the road changes in the changes file, one "set SRC DST LENGTH" or "close SRC DST" per
+line, repairing the tree after each. Reports how many cities the repairs touched and how long they took against
+a full search. With -v the tree is checked against a full search after every change.
+*/
+
+int updateTree(int argc, char *argv[]) {
+    int verify = argc > 1 && strcmp(argv[1], "-v") == 0;
+    argc -= verify;
+    argv += verify;
+    if (argc != 3 && argc != 4) {
+        printf("Usage: dijkstra-routing update [-v] <map> <changes> [SRC]\n");
+        exit(1);
+    }
+    loadGraph(&Graph, argv[1]);
+    indexCities(&Graph, &Names);
+    if (Graph.numNodes == 0) {
+        printf("No edges in the input\n");
+        exit(1);
+    }
+    int source = argc == 4 ? findCity(&Graph, &Names, argv[3], strlen(argv[3])) : cityAt(&Graph, 0);
+    if (source == -1) {
+        printf("Unknown city %s\n", argv[3]);
+        exit(1);
+    }
+
+    int V = Graph.numNodes;
+    int *dist = malloc(V * sizeof(int));
+    int *parent = malloc(V * sizeof(int));
+    int *expected = malloc(V * sizeof(int));
+    int *expectedParent = malloc(V * sizeof(int));
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    dijkstra(&Graph, source, dist, parent);
+    double fullSearch = millisSince(&start);
+
+    struct search s;
+    initSearch(&s, V);
+    size_t len;
+    char *data = mapFile(argv[2], &len);
+    char line[LINELEN];
+    int numChanges = 0;
+    long repaired = 0;
+    int wrong = 0;
+    double took = 0;
+    for (char *p = data, *end = data + len; p < end; ) {
+        char *nl = memchr(p, '\n', end - p);
+        int n = (nl == NULL ? end : nl) - p;
+        snprintf(line, sizeof(line), "%.*s", n, p);
+        p += n + 1;
+        if (strspn(line, " \t\r") == strlen(line)) {
+            continue;
+        }
+        int a, b, length;
+        const char *error = parseChange(line, &a, &b, &length);
+        if (error != NULL) {
+            printf("Change %d: %s\n", numChanges + 1, error);
+            exit(1);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int old = setRoad(&Graph, a, b, length);
+        if (old != length) {
+            repaired += repairTree(&s, &Graph, dist, parent, a, b, old, length);
+        }
+        took += millisSince(&start);
+        numChanges++;
+
+        if (verify) {
+            dijkstra(&Graph, source, expected, expectedParent);
+            for (int v = 0; v < V; v++) {
+                int ok = dist[v] == expected[v];
+                if (ok && parent[v] != -1) {
+                    long e = findRoad(&Graph, parent[v], v);
+                    ok = e != -1 && dist[parent[v]] + Graph.weights[e] == dist[v];
+                }
+                wrong += !ok;
+            }
+        }
+    }
+
+    printf("Applied %d changes to the tree from %s, repairing %ld cities in %.3f ms (a full search takes %.3f ms)\n",
+           numChanges, cityName(&Graph, source), repaired, took, fullSearch);
+    if (verify) {
+        printf("%d cities differed from a full search\n", wrong);
+        if (wrong > 0) {
+            exit(1);
+        }
+    }
+    return 0;
+}
+
+/* routeOnce()
+"dijkstra-routing route <map> SRC DST [dijkstra|bidir|alt|ch]": answers one route query from the command line
+with the named search (the hierarchy if the map has one, ALT if not) and reports how many cities it settled and
+how long it took.
+*/
+
+int routeOnce(int argc, char *argv[]) {
+    if (argc != 4 && argc != 5) {
+        printf("Usage: dijkstra-routing route <map> SRC DST [dijkstra|bidir|alt|ch]\n");
+        exit(1);
+    }
+    startGraph(argv[1]);
+    int method = argc == 5 ? searchNamed(argv[4]) : Graph.ranks != NULL ? HIERARCHY : ALT;
+    if (method == -1) {
+        printf("No %s search on this map\n", argv[4]);
+        exit(1);
+    }
+    int source = findCity(&Graph, &Names, argv[2], strlen(argv[2]));
+    int target = findCity(&Graph, &Names, argv[3], strlen(argv[3]));
+    if (source == -1 || target == -1) {
+        printf("Unknown city %s\n", source == -1 ? argv[2] : argv[3]);
+        exit(1);
+    }
+
+    struct worker w;
+    initWorker(&w);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int dist;
+    int n = findRoute(&w, method, source, target, &dist);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    struct reply r = { malloc(4096), 0, 4096 };
+    if (n == 0) {
+        addReply(&r, "No route from %s to %s\n", argv[2], argv[3]);
+    } else {
+        addReply(&r, "%d ", dist);
+        addPath(&r, w.pathNodes, n);
+        addReply(&r, "\n");
+    }
+    fwrite(r.data, 1, r.len, stdout);
+    printf("Settled %ld cities in %.3f ms\n", w.search.settled + (method >= BIDIRECTIONAL ? w.back.settled : 0),
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 0;
+}
+
+/* openCounter()
+Opens a counter of the cache misses of this thread, or returns -1 where the kernel or the machine does not
+allow one.
+*/
+
+int openCounter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* benchmark()
+"dijkstra-routing bench [-n routes] [-s searches] <map>": times whole searches and route queries (with the
+hierarchy if the map has one, ALT if not) between cities picked at random by their position in the map, so a
+map and its reordered compilation answer the same queries. Reports the cache misses of each where they can be
+counted, and the average gap between the indices of the two ends of a road, which is what reordering shrinks.
+*/
+
+int benchmark(int argc, char *argv[]) {
+    int opt;
+    int numRoutes = BENCHROUTES;
+    int numSearches = BENCHSEARCHES;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        if (opt == 'n') {
+            numRoutes = atoi(optarg);
+        } else if (opt == 's') {
+            numSearches = atoi(optarg);
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 || numRoutes < 0 || numSearches < 0) {
+        printf("Usage: dijkstra-routing bench [-n routes] [-s searches] <map>\n");
+        exit(1);
+    }
+    startGraph(argv[optind]);
+    int V = Graph.numNodes;
+    if (V == 0) {
+        printf("No edges in the input\n");
+        exit(1);
+    }
+
+    double gap = 0;
+    for (int u = 0; u < V; u++) {
+        for (uint32_t i = Graph.offsets[u]; i < Graph.offsets[u + 1]; i++) {
+            gap += abs(u - (int) Graph.targets[i]);
+        }
+    }
+    printf("%d cities %s, %.1f apart on average across a road\n", V,
+           Graph.places != NULL ? "reordered" : "in map order", gap / Graph.numArcs);
+
+    int most = numRoutes > numSearches ? numRoutes : numSearches;
+    int *ends = malloc(2 * (most + 1) * sizeof(int));
+    srand(1);
+    for (int i = 0; i < 2 * most; i++) {
+        ends[i] = cityAt(&Graph, rand() % V);
+    }
+
+    struct worker w;
+    initWorker(&w);
+    int method = Graph.ranks != NULL ? HIERARCHY : ALT;
+    int counter = openCounter();
+    for (int phase = 0; phase < 2; phase++) {
+        int count = phase == 0 ? numSearches : numRoutes;
+        if (count == 0) {
+            continue;
+        }
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long settled = 0;
+        for (int i = 0; i < count; i++) {
+            int dist;
+            if (phase == 0) {
+                searchFrom(&w.search, &Graph, ends[2 * i], -1);
+            } else {
+                findRoute(&w, method, ends[2 * i], ends[2 * i + 1], &dist);
+            }
+            settled += w.search.settled + (phase == 1 && method == HIERARCHY ? w.back.settled : 0);
+        }
+        double took = millisSince(&start);
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+
+        printf("%d %s: %.3f ms and %ld settled cities each", count, phase == 0 ? "whole searches" :
+               method == HIERARCHY ? "ch routes" : "alt routes", took / count, settled / count);
+        long long misses;
+        if (counter != -1 && read(counter, &misses, sizeof(misses)) == sizeof(misses)) {
+            printf(", %lld cache misses each", misses / count);
+        }
+        printf("\n");
+    }
+    if (counter == -1) {
+        printf("Cache misses cannot be counted here\n");
+    }
+    return 0;
+}
+
+/* compileMap()
+"dijkstra-routing compile [-c] [-r] [-l landmarks] [-t threads] <map.txt> <map.graph>": compiles a map into a
+graph file, with the distances to NUMLANDMARKS landmarks unless -l gives another number. With -c it also builds a
+contraction hierarchy, on as many threads as there are processors unless -t says otherwise. With -r the cities
+are first renumbered for locality (see reorderGraph()); the file keeps their places, so names and results still
+come out in the order of the map.
+*/
+
+int compileMap(int argc, char *argv[]) {
+    struct graph graph;
+    int opt;
+    int landmarks = NUMLANDMARKS;
+    int contract = 0;
+    int reorder = 0;
+    int numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "crl:t:")) != -1) {
+        if (opt == 'c') {
+            contract = 1;
+        } else if (opt == 'r') {
+            reorder = 1;
+        } else if (opt == 'l') {
+            landmarks = atoi(optarg);
+        } else if (opt == 't') {
+            numThreads = atoi(optarg);
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 2 || landmarks < 0) {
+        printf("Usage: dijkstra-routing compile [-c] [-r] [-l landmarks] [-t threads] <map.txt> <map.graph>\n");
+        exit(1);
+    }
+    if (numThreads < 1) {
+        numThreads = 1;
+    } else if (numThreads > MAXTHREADS) {
+        numThreads = MAXTHREADS;
+    }
+
+    loadGraph(&graph, argv[optind]);
+    if (reorder) {
+        reorderGraph(&graph);
+    }
+    chooseLandmarks(&graph, landmarks);
+    if (contract) {
+        buildHierarchy(&graph, numThreads);
+    }
+    saveGraph(&graph, argv[optind + 1]);
+    printf("Compiled %d cities and %u edges into %s\n", graph.numNodes, graph.numArcs / 2, argv[optind + 1]);
+    if (contract) {
+        uint32_t shortcuts = 0;
+        for (uint32_t i = 0; i < graph.numUpArcs; i++) {
+            shortcuts += graph.upMiddles[i] != -1;
+        }
+        printf("Contraction hierarchy of %u arcs, %u of them shortcuts\n", graph.numUpArcs, shortcuts);
+    }
+    return 0;
+}
+
+/* Main()
+Runs the subcommand named by the first argument, if any. Otherwise loads the map named (or standard input), prints
+the graph as a matrix of road lengths unless -q was given, then the list of cities, and executes Dijkstra's
+Algorithm from the first city, printing the shortest path to each other city and its distance from the source.
+*/
+
+int main(int argc, char *argv[]) {
+
+    struct graph graph;
+
+    if (argc >= 2 && strcmp(argv[1], "serve") == 0) {
+        return serve(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "compile") == 0) {
+        return compileMap(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "route") == 0) {
+        return routeOnce(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "batch") == 0) {
+        return batch(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "sssp") == 0) {
+        return singleSource(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "update") == 0) {
+        return updateTree(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        return benchmark(argc - 1, argv + 1);
+    }
+    int opt;
+    int skipMatrix = 0;
+    while ((opt = getopt(argc, argv, "q")) != -1) {
+        if (opt == 'q') {
+            skipMatrix = 1;
+        } else {
+            argc = 0;
+        }
+    }
+    if (argc == 0 || argc - optind > 1) {
+        printf("Usage: %s [-q] [map]\n"
+               "       %s compile [-c] [-r] [-l landmarks] [-t threads] <map.txt> <map.graph>\n"
+               "       %s route <map> SRC DST [dijkstra|bidir|alt|ch]\n"
+               "       %s batch [-s sources] [-b] [-o output] [-t threads] <map>\n"
+               "       %s sssp [-d delta] [-t threads] [-q] [-v] <map> [SRC]\n"
+               "       %s update [-v] <map> <changes> [SRC]\n"
+               "       %s bench [-n routes] [-s searches] <map>\n"
+               "       %s serve [-p port] [-u socket path] [-w workers] <map>\n",
+               argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+        exit(1);
+    }
+
+    loadGraph(&graph, optind < argc ? argv[optind] : NULL);
+    if (graph.numNodes == 0) {
+        printf("No edges in the input\n");
+        exit(1);
+    }
+    int V = graph.numNodes;
+    struct writer *out = malloc(sizeof(struct writer));
+    out->fd = STDOUT_FILENO;
+    out->used = 0;
+
+    // Print the graph to the screen as an adjacency matrix, one row at a time, unless -q was given
+    if (!skipMatrix) {
+        int *row = malloc(V * sizeof(int));
+        for (int p = 0; p < V; p++) {
+            row[p] = NOROAD;
+        }
+        writeString(out, "\nGraph:\n");
+        for (int k = 0; k < V; k++) {
+            int u = cityAt(&graph, k);
+            for (uint32_t i = graph.offsets[u]; i < graph.offsets[u + 1]; i++) {
+                row[positionOf(&graph, graph.targets[i])] = graph.weights[i];
+            }
+            for (int p = 0; p < V; p++) {
+                writeNumber(out, row[p], 5);
+                writeText(out, " ", 1);
+            }
+            writeText(out, "\n", 1);
+            for (uint32_t i = graph.offsets[u]; i < graph.offsets[u + 1]; i++) {
+                row[positionOf(&graph, graph.targets[i])] = NOROAD;
+            }
+        }
+        free(row);
+    }
+
+    // Print the list of cities to the screen
+    writeString(out, "\n\nCities:\n");
+    for (int l = 0; l < V; l++) {
+        writeNumber(out, l, 0);
+        writeText(out, ": ", 2);
+        writeString(out, cityName(&graph, cityAt(&graph, l)));
+        writeText(out, "\n", 1);
+    }
+    writeString(out, "\n\n");
+
+    // Dijkstra's Algorithm from the first city
+    int *distances = malloc(V * sizeof(int));
+    int *parent = malloc(V * sizeof(int));
+    int *nodes = malloc(V * sizeof(int));
+    dijkstra(&graph, cityAt(&graph, 0), distances, parent);
+
+    // Print the paths to the screen
+    writeString(out, "\nPaths:\n");
+    for (int l = 1; l < V; l++) {
+        int t = cityAt(&graph, l);
+        if (distances[t] == INT_MAX) {
+            writeString(out, "No path to ");
+            writeString(out, cityName(&graph, t));
+            writeText(out, "\n", 1);
+            continue;
+        }
+        findPathToDest(out, nodes, parent, t, &graph);
+        writeText(out, "\n", 1);
     }
-    printf("\n");
+    writeText(out, "\n", 1);
 
     // Print the distances to the screen
-    for (int t = 1; t < V; t++) {
-        printf("Dist to %s: %d\n", cities[t], distances[t]);
+    for (int l = 1; l < V; l++) {
+        int t = cityAt(&graph, l);
+        writeString(out, "Dist to ");
+        writeString(out, cityName(&graph, t));
+        writeText(out, ": ", 2);
+        writeNumber(out, distances[t], 0);
+        writeText(out, "\n", 1);
     }
-    printf("\n");
+    writeText(out, "\n", 1);
+    flushWriter(out);
 
     return 0;
 }
@@ -0,0 +1,551 @@
+/*
+Benchmark for the microservice stack, run against servers on this machine (or the address given with -a).
+
+In udp mode, each client thread sends tagged requests straight to the microservers in a closed loop (one request
+outstanding per client) for the given number of seconds. The mix of operations is given as weights, e.g.
+-m translate=50,convert=30,show=5,ballot=10,summary=5. Ballots use made-up voter addresses unique to the run, so
+they all count. Every reply is checked against the answer the service should give.
+
+In telnet mode, each client thread plays scripted users through the interserver's menus (translate, convert,
+vote, summary, exit), one session at a time, until the given number of users have finished. Each user connects
+from its own loopback address (127.x.y.z) so its vote counts; a user who has voted in an earlier run is told they
+can only vote once, which is reported separately and not counted as wrong.
+
+Both modes print a report with one line per operation (or menu step): count, timeouts/errors, wrong replies,
+throughput and latency percentiles in microseconds, in a fixed layout so runs against different builds can be
+compared line by line.
+
+Usage:
+    bench udp [-c clients] [-d seconds] [-m mix] [-a address]
+    bench telnet [-c clients] [-u users] [-a address] [-p port]
+
+Compile with -pthread.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define CLIENTPORTNUM 9000
+#define MSERVER1 8725
+#define MSERVER2 9571
+#define MSERVER3 8552
+#define MSGLEN 3000
+#define MAXCLIENTS 1024
+#define TIMEOUTMS 2000      // a request not answered in this time counts as an error
+#define LATBUCKETS 128      // latency histogram buckets, four per power of two
+#define MAXSTATS 16
+#define NUMCANDIDATES 4     // candidates in the shipped candidates.txt, ballots pick one of them
+
+// Operations of udp mode
+#define TRANSLATE 0
+#define CONVERT 1
+#define SHOW 2
+#define BALLOT 3
+#define SUMMARY 4
+#define NUMOPS 5
+
+// Results of one kind of operation
+struct op_stats {
+    long count;
+    long errors;            // timeouts, closed connections
+    long wrong;             // answered, but not with the expected reply
+    long repeats;           // votes refused because the voter had voted in an earlier run
+    long maxUs;
+    long hist[LATBUCKETS];
+};
+
+struct client {
+    pthread_t thread;
+    int id;
+    unsigned int seed;
+    struct op_stats stats[MAXSTATS];
+};
+
+// A line of the telnet script: what the user types and what the reply must contain
+struct step {
+    char *name;
+    char *send;             // NULL for the greeting, "%d" for the candidate ID
+    char *expect;
+};
+
+struct step Script[] = {
+    {"connect", NULL, "Please make your selection"},
+    {"translate", "translate", "Enter an English word"},
+    {"word", "Hello", "French translation: Bonjour"},
+    {"convert", "convert", "<amount> <source currency> <dest currency>"},
+    {"amount", "10 USD CAD", "10 USD is 12.30 CAD"},
+    {"vote-menu", "vote", ">> summary"},
+    {"vote", "vote", "Enter the ID of the candidate"},
+    {"candidate", "%d", ">> exit"},
+    {"summary", "summary", "Here are the results"},
+    {"leave-vote", "exit", "Please choose another service"},
+    {"exit", "exit", "Thank you for your time"},
+};
+
+#define NUMSTEPS (int) (sizeof(Script) / sizeof(Script[0]))
+#define SESSION NUMSTEPS    // stats slot for whole telnet sessions
+
+char *OpNames[NUMOPS] = {"translate", "convert", "show", "ballot", "summary"};
+int Mix[NUMOPS] = {50, 30, 5, 10, 5};
+int MixTotal;
+
+char *Words[][2] = {
+    {"Hello", "Bonjour"}, {"Goodbye", "Au revoir"}, {"Computer", "Ordinateur"},
+    {"Ostrich", "Autruche"}, {"Wine", "Vin"}, {"Cheese", "Undefined"},
+};
+char *Conversions[][2] = {
+    {"10 USD CAD", "12.30"}, {"100 EUR CAD", "144.00"}, {"5 CAD CAD", "5.00"}, {"1 CAD USD", "0.81"},
+};
+
+struct client Clients[MAXCLIENTS];
+int NumClients = 8;
+struct in_addr ServerAddr;
+volatile int Stop = 0;
+long UsersLeft = 1000;
+int ClientPort = CLIENTPORTNUM;
+unsigned int RunId;
+
+/* nowUs()
+Returns a monotonic timestamp in microseconds.
+*/
+
+long nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* latBucket()
+Returns the histogram bucket for a latency: four buckets per power of two microseconds.
+*/
+
+int latBucket(long us) {
+    if (us < 4) {
+        return us < 0 ? 0 : us;
+    }
+    int msb = 63 - __builtin_clzl(us);
+    int b = msb * 4 + ((us >> (msb - 2)) & 3);
+    return b < LATBUCKETS ? b : LATBUCKETS - 1;
+}
+
+/* bucketLimit()
+Returns the largest latency, in microseconds, that falls in a histogram bucket.
+*/
+
+long bucketLimit(int b) {
+    if (b < 4) {
+        return b;
+    }
+    int msb = b / 4;
+    return ((long) (4 + b % 4 + 1) << (msb - 2)) - 1;
+}
+
+/* record()
+Adds one operation's outcome and latency to a client's statistics.
+*/
+
+int record(struct op_stats *s, long us, int ok) {
+    s->count++;
+    if (ok == -1) {
+        s->errors++;
+        return 0;
+    }
+    if (ok == 0) {
+        s->wrong++;
+    }
+    s->hist[latBucket(us)]++;
+    if (us > s->maxUs) {
+        s->maxUs = us;
+    }
+    return 0;
+}
+
+/* udpCall()
+Sends a request tagged "@<tag> " to a microserver and waits up to TIMEOUTMS for the reply with the same tag,
+which is copied (without its tag) into reply. Returns the reply length, or -1 on timeout.
+*/
+
+int udpCall(int sockfd, int port, long tag, char *request, char *reply) {
+    char msg[MSGLEN];
+    char prefix[32];
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = ServerAddr;
+
+    int prefixLen = sprintf(prefix, "@%lx ", tag);
+    int len = snprintf(msg, MSGLEN, "%s%s", prefix, request);
+    if (sendto(sockfd, msg, len, 0, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        return -1;
+    }
+
+    long deadline = nowUs() + TIMEOUTMS * 1000L;
+    while (1) {
+        long left = deadline - nowUs();
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        if (left <= 0 || poll(&pfd, 1, (left + 999) / 1000) <= 0) {
+            return -1;
+        }
+        int n = recv(sockfd, msg, MSGLEN - 1, 0);
+        if (n < prefixLen || strncmp(msg, prefix, prefixLen) != 0) {
+            // A late reply to a request that already timed out
+            continue;
+        }
+        msg[n] = '\0';
+        strcpy(reply, msg + prefixLen);
+        return n - prefixLen;
+    }
+}
+
+/* udpClient()
+Client thread for udp mode. Picks operations according to the mix until told to stop, and checks each reply.
+*/
+
+void *udpClient(void *arg) {
+    struct client *c = arg;
+    char request[MSGLEN];
+    char reply[MSGLEN];
+    char voter[40] = "";
+    long seq = 0;
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sockfd == -1) {
+        printf("Socket() call failed\n");
+        exit(1);
+    }
+
+    while (!Stop) {
+        int r = rand_r(&c->seed) % MixTotal;
+        int op = 0;
+        while (r >= Mix[op]) {
+            r -= Mix[op++];
+        }
+
+        long tag = ((long) c->id << 32) | ++seq;
+        int port;
+        char *expect;
+        int exact = 1;
+
+        if (op == TRANSLATE) {
+            int w = rand_r(&c->seed) % (sizeof(Words) / sizeof(Words[0]));
+            strcpy(request, Words[w][0]);
+            expect = Words[w][1];
+            port = MSERVER1;
+        } else if (op == CONVERT) {
+            int v = rand_r(&c->seed) % (sizeof(Conversions) / sizeof(Conversions[0]));
+            strcpy(request, Conversions[v][0]);
+            expect = Conversions[v][1];
+            port = MSERVER2;
+        } else if (op == SHOW) {
+            sprintf(request, "show 127.0.0.1");
+            expect = "The candidates are:";
+            exact = 0;
+            port = MSERVER3;
+        } else if (op == BALLOT) {
+            // A new voter for every ballot, unique to this run
+            snprintf(voter, sizeof(voter), "%x.%d.%lx", RunId & 0xffffff, c->id, seq);
+            sprintf(request, "ballot %s %d %x%lx", voter, rand_r(&c->seed) % NUMCANDIDATES + 1, RunId, tag);
+            expect = "vote counted";
+            port = MSERVER3;
+        } else {
+            // The last voter of this client may see the results; before its first ballot the answer is "N"
+            sprintf(request, "summary %s", voter[0] ? voter : "0.0.0.0");
+            expect = voter[0] ? "Here are the results:" : "N";
+            exact = voter[0] == '\0';
+            port = MSERVER3;
+        }
+
+        long start = nowUs();
+        int ok = udpCall(sockfd, port, tag, request, reply) == -1 ? -1 :
+                 exact ? strcmp(reply, expect) == 0 : strstr(reply, expect) != NULL;
+        record(&c->stats[op], nowUs() - start, ok);
+    }
+
+    close(sockfd);
+    return NULL;
+}
+
+/* readReply()
+Reads the interserver's replies for one step of a session into text (with the NUL padding of each MSGLEN-byte
+message dropped) until one ends in a prompt, or the session ends. Returns -1 if the connection failed or timed out.
+*/
+
+int readReply(int sockfd, char *text, int cap) {
+    char msg[MSGLEN];
+    int len = 0;
+
+    text[0] = '\0';
+    while (1) {
+        // Every reply is sent as a whole MSGLEN-byte message
+        int got = 0;
+        while (got < MSGLEN) {
+            int n = recv(sockfd, msg + got, MSGLEN - got, 0);
+            if (n <= 0) {
+                return len > 0 && strstr(text, "Thank you") != NULL ? 0 : -1;
+            }
+            got += n;
+        }
+        msg[MSGLEN - 1] = '\0';
+        int n = strlen(msg);
+        if (len + n < cap) {
+            memcpy(text + len, msg, n + 1);
+            len += n;
+        }
+
+        if (len >= 2 && (strcmp(text + len - 2, ": ") == 0 || (len >= 3 && strcmp(text + len - 3, ">> ") == 0))) {
+            return 0;
+        }
+        if (strstr(msg, "Thank you for your time") != NULL) {
+            return 0;
+        }
+    }
+}
+
+/* telnetSession()
+Plays one scripted user through the interserver's menus from the given loopback address, recording every step.
+Returns 0 if the whole script went as expected.
+*/
+
+int telnetSession(struct client *c, long user) {
+    char text[4 * MSGLEN];
+    char line[64];
+    struct sockaddr_in local, server;
+    struct timeval tv = { TIMEOUTMS / 1000 * 5, 0 };
+    int failed = 0;
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        printf("Socket() call failed\n");
+        exit(1);
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // Each user votes from an address of its own
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(0x7f000000 | (((RunId & 0x7f) + 1) << 16) | (user & 0xffff));
+    bind(sockfd, (struct sockaddr *) &local, sizeof(local));
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(ClientPort);
+    server.sin_addr = ServerAddr;
+
+    long start = nowUs();
+    if (connect(sockfd, (struct sockaddr *) &server, sizeof(server)) == -1) {
+        record(&c->stats[0], 0, -1);
+        close(sockfd);
+        return -1;
+    }
+
+    for (int i = 0; i < NUMSTEPS && !failed; i++) {
+        struct step *s = &Script[i];
+        long stepStart = nowUs();
+        if (s->send != NULL) {
+            int n = strcmp(s->send, "%d") == 0 ? sprintf(line, "%d\r\n", rand_r(&c->seed) % NUMCANDIDATES + 1) : sprintf(line, "%s\r\n", s->send);
+            send(sockfd, line, n, 0);
+        }
+
+        if (readReply(sockfd, text, sizeof(text)) == -1) {
+            record(&c->stats[i], nowUs() - stepStart, -1);
+            failed = 1;
+        } else if (strstr(text, s->expect) == NULL) {
+            record(&c->stats[i], nowUs() - stepStart, 0);
+            failed = 1;
+        } else {
+            record(&c->stats[i], nowUs() - stepStart, 1);
+            if (strstr(text, "You can only vote once") != NULL) {
+                c->stats[i].repeats++;
+            }
+        }
+    }
+    close(sockfd);
+    record(&c->stats[SESSION], nowUs() - start, failed ? 0 : 1);
+    return failed ? -1 : 0;
+}
+
+/* telnetClient()
+Client thread for telnet mode. Runs sessions one after another until all users have been played.
+*/
+
+void *telnetClient(void *arg) {
+    struct client *c = arg;
+    long user;
+    while ((user = __atomic_sub_fetch(&UsersLeft, 1, __ATOMIC_RELAXED)) >= 0) {
+        telnetSession(c, user);
+    }
+    return NULL;
+}
+
+/* report()
+Adds up the clients' statistics for each operation and prints one line per operation.
+*/
+
+int report(char **names, int numStats, double seconds) {
+    printf("%-12s %9s %7s %7s %7s %10s %9s %9s %9s %9s %9s\n",
+           "op", "count", "errors", "wrong", "repeat", "ops/s", "p50us", "p90us", "p99us", "p999us", "maxus");
+
+    for (int op = 0; op < numStats; op++) {
+        struct op_stats total;
+        memset(&total, 0, sizeof(total));
+        for (int i = 0; i < NumClients; i++) {
+            struct op_stats *s = &Clients[i].stats[op];
+            total.count += s->count;
+            total.errors += s->errors;
+            total.wrong += s->wrong;
+            total.repeats += s->repeats;
+            if (s->maxUs > total.maxUs) {
+                total.maxUs = s->maxUs;
+            }
+            for (int b = 0; b < LATBUCKETS; b++) {
+                total.hist[b] += s->hist[b];
+            }
+        }
+        if (total.count == 0) {
+            continue;
+        }
+
+        // Percentiles of the answered operations, as the upper end of their bucket
+        int pcts[4] = {500, 900, 990, 999};
+        long values[4] = {0, 0, 0, 0};
+        long answered = total.count - total.errors;
+        for (int p = 0; p < 4 && answered > 0; p++) {
+            long want = (answered * pcts[p] + 999) / 1000;
+            long seen = 0;
+            int b = 0;
+            while (b < LATBUCKETS - 1 && (seen += total.hist[b]) < want) {
+                b++;
+            }
+            values[p] = bucketLimit(b) < total.maxUs ? bucketLimit(b) : total.maxUs;
+        }
+
+        printf("%-12s %9ld %7ld %7ld %7ld %10.1f %9ld %9ld %9ld %9ld %9ld\n", names[op], total.count, total.errors,
+               total.wrong, total.repeats, total.count / seconds, values[0], values[1], values[2], values[3], total.maxUs);
+    }
+    return 0;
+}
+
+/* parseMix()
+Reads operation weights of the form "translate=50,convert=30,...". Operations not named get weight 0.
+*/
+
+int parseMix(char *arg) {
+    char *save;
+    memset(Mix, 0, sizeof(Mix));
+    for (char *item = strtok_r(arg, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        int op = 0;
+        if (eq != NULL) {
+            *eq = '\0';
+            while (op < NUMOPS && strcmp(item, OpNames[op]) != 0) {
+                op++;
+            }
+        }
+        if (eq == NULL || op == NUMOPS) {
+            printf("Bad mix entry %s\n", item);
+            exit(1);
+        }
+        Mix[op] = atoi(eq + 1);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int seconds = 10;
+    int opt;
+    char *address = "127.0.0.1";
+
+    if (argc < 2 || (strcmp(argv[1], "udp") != 0 && strcmp(argv[1], "telnet") != 0)) {
+        printf("Usage: %s udp [-c clients] [-d seconds] [-m mix] [-a address]\n", argv[0]);
+        printf("       %s telnet [-c clients] [-u users] [-a address] [-p port]\n", argv[0]);
+        exit(1);
+    }
+    int udp = strcmp(argv[1], "udp") == 0;
+
+    optind = 2;
+    while ((opt = getopt(argc, argv, "c:d:m:u:a:p:")) != -1) {
+        if (opt == 'c') {
+            NumClients = atoi(optarg);
+        } else if (opt == 'd') {
+            seconds = atoi(optarg);
+        } else if (opt == 'm') {
+            parseMix(optarg);
+        } else if (opt == 'u') {
+            UsersLeft = atol(optarg);
+        } else if (opt == 'a') {
+            address = optarg;
+        } else if (opt == 'p') {
+            ClientPort = atoi(optarg);
+        } else {
+            printf("Unknown option\n");
+            exit(1);
+        }
+    }
+    if (NumClients < 1 || NumClients > MAXCLIENTS) {
+        printf("Clients must be between 1 and %d\n", MAXCLIENTS);
+        exit(1);
+    }
+    if (inet_pton(AF_INET, address, &ServerAddr) != 1) {
+        printf("Invalid address %s\n", address);
+        exit(1);
+    }
+    for (int op = 0; op < NUMOPS; op++) {
+        MixTotal += Mix[op];
+    }
+    if (udp && MixTotal == 0) {
+        printf("The mix is empty\n");
+        exit(1);
+    }
+
+    RunId = time(NULL) ^ (getpid() << 8);
+    long users = UsersLeft;
+    for (int i = 0; i < NumClients; i++) {
+        Clients[i].id = i;
+        Clients[i].seed = RunId ^ (i * 2654435761u);
+        if (pthread_create(&Clients[i].thread, NULL, udp ? udpClient : telnetClient, &Clients[i]) != 0) {
+            printf("Could not start client %d\n", i);
+            exit(1);
+        }
+    }
+
+    long start = nowUs();
+    if (udp) {
+        sleep(seconds);
+        Stop = 1;
+    }
+    for (int i = 0; i < NumClients; i++) {
+        pthread_join(Clients[i].thread, NULL);
+    }
+    double elapsed = (nowUs() - start) / 1e6;
+
+    if (udp) {
+        printf("mode udp clients %d seconds %.2f mix", NumClients, elapsed);
+        for (int op = 0; op < NUMOPS; op++) {
+            printf("%c%s=%d", op ? ',' : ' ', OpNames[op], Mix[op]);
+        }
+        printf("\n");
+        report(OpNames, NUMOPS, elapsed);
+    } else {
+        char *names[MAXSTATS];
+        for (int i = 0; i < NUMSTEPS; i++) {
+            names[i] = Script[i].name;
+        }
+        names[SESSION] = "session";
+        printf("mode telnet clients %d users %ld seconds %.2f\n", NumClients, users, elapsed);
+        report(names, NUMSTEPS + 1, elapsed);
+    }
+    return 0;
+}
@@ -5,9 +5,43 @@ three services is handled by a microserver program, which are connected to via U
 client’s commands and forwards them to the corresponding microserver, which processes it and sends back a response. The 
 translator has a 5-word vocabulary, which is specified to the client. The converter can convert between any of 5 specified 
 currencies. The voting service can show candidates, accept a vote (if the client hasn’t voted already), and 
-show the election results (if the client has voted).
+show the election results (if the client has voted). A vote is sent to the voting microserver as a single "ballot" 
+request with a random token, so it can be retried after packet loss without being counted twice.
+
+Every microserver call is tagged so its reply can be matched to the attempt that caused it. The round-trip
+time of each service is tracked across all sessions (smoothed RTT and variance, as in TCP) and sets the
+retransmission timeout; requests are retried up to MAXTRIES times with exponential backoff. Started with -h,
+the interserver also sends a hedged duplicate of a request that has been waiting longer than the service's
+95th percentile round trip.
+
+The microservers are listed in a config file (microservers.txt, or main-server -c <file>), which may give several
+replicas of a service. Each attempt goes to the less busy of two random replicas (requests in flight, counted
+across sessions). A replica that times out EJECTAFTER times in a row is ejected for a while; once that time is up
+it receives a single probe request and is re-admitted if it answers. A replica on the same host may be listed
+with a Unix-domain socket path instead of a host and port.
+
+Translations and conversions are answered from a result cache shared by all sessions when the same (normalised)
+request has been seen before. Translations stay cached until evicted; conversions only while the converter reports
+the same exchange rate version, which is checked every RATESTTL. The version is a hash of the converter's rate
+table, so replicas with the same rates agree on it and any change to the rates gives a new one. When several
+sessions miss on the same request, only one of them asks the microserver.
+
+Load is bounded before it reaches the microservers. At most MAXSLOTS sessions (main-server -m <sessions>) run
+at once, and each client IP has a token bucket of TOKENRATE requests per second (main-server -r <rate>) that is
+charged for every connection and every microserver call. A service takes MAXINFLIGHT calls at a time; further
+calls wait in a queue of QUEUELEN, admitted by deficit round robin between sessions. A connection or call that is
+not admitted is answered with a "busy" message straight away.
+
+Each session counts its microserver calls, send failures, timeouts, retries, hedges and call latencies (and its
+own duration) in a metrics slot of its own, so sessions never write to the same cache lines; slots are never
+shared, and a connection that finds them all taken is turned away as busy. The hidden command "stats" at the
+service menu shows the totals, and a separate process writes them to main-server.stats every STATSEVERY seconds
+(main-server -s <seconds>, 0 to turn off). Finished sessions are reaped by the listener, woken by a
+SIGCHLD handler.
+Compile with -pthread.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -18,15 +52,1150 @@ show the election results (if the client has voted).
 #include <arpa/inet.h> 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <ctype.h>
+#include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 
 #define CLIENTPORTNUM 9000
-#define MSERVER1 8725
-#define MSERVER2 9571
-#define MSERVER3 8552
 #define MSGLEN 3000
+#define CONFIGFILE "microservers.txt"
+#define MAXREPLICAS 16      // endpoints listed for one microservice
+
+// Microservices
+#define NUMSERVICES 3
+#define TRANSLATOR 0
+#define CONVERTER 1
+#define VOTING 2
+
+// Retransmission of microserver requests, times in microseconds
+#define INITRTO 1000000     // timeout before any round trip has been measured
+#define MINRTO 20000
+#define MAXRTO 1000000
+#define MAXTRIES 3          // sends of a request, including the first
+#define HEDGESAMPLES 20     // round trips measured before hedging starts
+#define RTTBUCKETS 128      // histogram buckets, four per power of two
+
+// Replica health
+#define EJECTAFTER 3        // consecutive timeouts that take a replica out of rotation
+#define EJECTUS 2000000     // first ejection time, doubled for every failed probe
+#define MAXEJECTUS 60000000
+
+// Result cache for translations and conversions
+#define CACHESETS 1024      // independently locked sets, a power of two
+#define CACHEWAYS 8         // entries per set, the least recently used is replaced
+#define KEYLEN 64           // longest normalised request that is cached
+#define VALUELEN 64         // longest reply that is cached
+#define RATESTTL 60000000   // how long a known exchange rate version is trusted, in microseconds
+#define FILLUS (MAXRTO * MAXTRIES)  // how long other sessions wait for a miss being filled
+
+// Metrics
+#define MAXSLOTS 128        // most sessions at once, each with a metrics slot of its own
+#define STATSFILE "main-server.stats"
+#define STATSEVERY 10       // seconds between dumps of the metrics to STATSFILE
+
+// Admission control
+#define BACKLOG 64          // connections waiting to be accepted
+#define TOKENRATE 20        // requests per second allowed from one client IP (main-server -r)
+#define TOKENBURST 40       // requests one client IP may make at once
+#define IPBUCKETS 1024      // token buckets, one per recently seen client IP, a power of two
+#define MAXINFLIGHT 32      // calls to one microservice in progress at once
+#define QUEUELEN 64         // calls waiting for a microservice before new ones are turned away
+#define QUEUEUS 500000      // longest wait in a service queue, in microseconds
+#define QUANTUM 64          // request bytes a waiting session is credited per round of the queue
+#define BUSY -2             // callService() result for a request that was not admitted
+#define OWNCALL 0           // callService() client for the interserver's own calls, charged to no token bucket
+#define BUSYMSG "This service is busy right now. Please try again in a moment.\n"
+#define UNAVAILABLEMSG "This service is temporarily unavailable. Please try again later.\n"
+
+// Cache entry states
+#define EMPTY 0
+#define FILLING 1
+#define READY 2
+
+// Round-trip statistics for one microservice, shared by all sessions
+struct rtt_stats {
+    long srtt;              // smoothed round trip, 0 until the first sample
+    long rttvar;            // smoothed mean deviation
+    long samples;
+    long hist[RTTBUCKETS];
+};
+
+// One endpoint of a microservice
+struct replica {
+    struct sockaddr_storage addr;   // UDP or Unix-domain address
+    socklen_t addrLen;
+    char name[256];         // host:port or unix:path, for log lines
+    int inflight;           // attempts sent to it by calls that have not finished
+    int failures;           // consecutive timeouts
+    int ejections;          // consecutive ejections, each one twice as long
+    long ejectedUntil;      // 0 while in rotation
+};
+
+// Calls waiting for a microservice, served by deficit round robin over the session slots
+struct service_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t admitted;
+    int inflight;           // calls admitted and not finished
+    int waiting;
+    int next;               // slot the round continues from
+    int cost[MAXSLOTS];     // request bytes of each slot's waiting call, 0 if none
+    int deficit[MAXSLOTS];
+    int granted[MAXSLOTS];
+    int calls[MAXSLOTS];    // each slot's share of inflight
+};
+
+// A microservice and its replicas, shared by all sessions
+struct service {
+    int numReplicas;
+    struct replica replicas[MAXREPLICAS];
+    struct rtt_stats rtt;
+    struct service_queue queue;
+};
+
+// Request allowance of one client IP, in thousandths of a request
+struct ip_bucket {
+    long tokens;
+    long refilledAt;
+};
+
+// Token buckets of the client IPs, shared by the listener and the sessions
+struct rate_limiter {
+    pthread_mutex_t lock;
+    long rate;              // requests per second
+    struct ip_bucket buckets[IPBUCKETS];
+};
+
+// A cached reply, keyed by the normalised request
+struct cache_entry {
+    char key[KEYLEN];
+    char value[VALUELEN];
+    int state;
+    int valueLen;
+    long ratesVersion;      // exchange rates a conversion was made with
+    long lastUsed;
+    long fillingSince;
+};
+
+struct cache_set {
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    struct cache_entry entries[CACHEWAYS];
+};
+
+// Result cache shared by all sessions
+struct result_cache {
+    long ratesVersion;      // 0 if unknown, then conversions are not cached
+    long ratesCheckedAt;
+    long clock;             // use counter for the LRU
+    long hits;
+    long misses;
+    long coalesced;         // misses answered by another session's request
+    struct cache_set sets[CACHESETS];
+};
+
+// Counters for one microservice, kept by one session slot
+struct service_metrics {
+    long calls;
+    long sendFailures;
+    long timeouts;          // attempts that went unanswered until the retransmission timeout
+    long retries;
+    long hedges;
+    long failures;          // calls that got no answer at all
+    long busy;              // calls turned away by admission control
+    long hist[RTTBUCKETS];  // latency of answered calls
+};
+
+// Counters written by the sessions using one slot, on cache lines of their own
+struct session_metrics {
+    long started;
+    long ended;
+    long hist[RTTBUCKETS];  // durations of sessions that ended normally
+    struct service_metrics services[NUMSERVICES];
+} __attribute__((aligned(64)));
+
+// All metrics, shared by the listener, the sessions and the stats dumper
+struct metrics {
+    int active;             // sessions running, maintained by the listener
+    long refused;           // connections turned away as busy
+    pid_t slotPids[MAXSLOTS];
+    struct session_metrics slots[MAXSLOTS];
+};
+
+struct service *Services;
+struct result_cache *Cache;
+struct rate_limiter *Limiter;
+struct metrics *Metrics;
+struct session_metrics *MySlot;     // this session's slot
+pid_t DumperPid;
+int ReapPipe[2];                    // written by the SIGCHLD handler to wake the listener
+int Hedging = 0;
+int ServiceSocket;
+int UnixSocket = -1;                // this session's socket for Unix-domain replicas, if there are any
+in_addr_t ClientIp;                 // this session's client, for rate limiting
+char *ServiceNames[NUMSERVICES] = {"translator", "converter", "voting"};
+
+/* nowUs()
+Returns a monotonic timestamp in microseconds.
+*/
+
+long nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* rttBucket()
+Returns the histogram bucket for a round trip: four buckets per power of two microseconds.
+*/
+
+int rttBucket(long us) {
+    if (us < 4) {
+        return us < 0 ? 0 : us;
+    }
+    int msb = 63 - __builtin_clzl(us);
+    int b = msb * 4 + ((us >> (msb - 2)) & 3);
+    return b < RTTBUCKETS ? b : RTTBUCKETS - 1;
+}
+
+/* bucketLimit()
+Returns the largest round trip, in microseconds, that falls in a histogram bucket.
+*/
+
+long bucketLimit(int b) {
+    if (b < 4) {
+        return b;
+    }
+    int msb = b / 4;
+    return ((long) (4 + b % 4 + 1) << (msb - 2)) - 1;
+}
+
+/* histPercentile()
+Returns the round trip below which the given percentage of a histogram's samples fall.
+*/
+
+long histPercentile(long *hist, long samples, int pct) {
+    long want = (samples * pct + 99) / 100;
+    long seen = 0;
+    for (int b = 0; b < RTTBUCKETS; b++) {
+        seen += __atomic_load_n(&hist[b], __ATOMIC_RELAXED);
+        if (seen >= want) {
+            return bucketLimit(b);
+        }
+    }
+    return bucketLimit(RTTBUCKETS - 1);
+}
+
+/* rttSample()
+Folds a measured round trip into a service's smoothed RTT and variance (RFC 6298) and its histogram.
+Sessions update the shared estimate without locking; a lost update only delays convergence.
+*/
+
+int rttSample(int svc, long rtt) {
+    struct rtt_stats *s = &Services[svc].rtt;
+    long srtt = __atomic_load_n(&s->srtt, __ATOMIC_RELAXED);
+    long rttvar = __atomic_load_n(&s->rttvar, __ATOMIC_RELAXED);
+
+    if (srtt == 0) {
+        srtt = rtt;
+        rttvar = rtt / 2;
+    } else {
+        rttvar = (3 * rttvar + labs(srtt - rtt)) / 4;
+        srtt = (7 * srtt + rtt) / 8;
+    }
+    __atomic_store_n(&s->srtt, srtt > 0 ? srtt : 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->rttvar, rttvar, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->hist[rttBucket(rtt)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->samples, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* serviceRto()
+Returns the retransmission timeout for a service: SRTT + 4 * RTTVAR, kept between MINRTO and MAXRTO.
+*/
+
+long serviceRto(int svc) {
+    long srtt = __atomic_load_n(&Services[svc].rtt.srtt, __ATOMIC_RELAXED);
+    long rttvar = __atomic_load_n(&Services[svc].rtt.rttvar, __ATOMIC_RELAXED);
+    if (srtt == 0) {
+        return INITRTO;
+    }
+    long rto = srtt + 4 * rttvar;
+    return rto < MINRTO ? MINRTO : rto > MAXRTO ? MAXRTO : rto;
+}
+
+/* loadConfig()
+Reads the microserver endpoints from a config file with one "<service> <host> <port>" line per replica, where
+service is one of ServiceNames. A replica on the same host can instead be given as "<service> unix <path>" to be
+reached over a Unix-domain datagram socket (the microserver started with -u <path>), which skips the UDP/IP stack.
+Lines starting with # are comments. Every service needs at least one replica.
+*/
+
+int loadConfig(char *path) {
+    char line[256];
+    char name[32];
+    char host[128];
+    char where[128];
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        printf("Could not open config file %s\n", path);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%31s %127s %127s", name, host, where) != 3) {
+            continue;
+        }
+
+        int svc = 0;
+        while (svc < NUMSERVICES && strcasecmp(name, ServiceNames[svc]) != 0) {
+            svc++;
+        }
+        if (svc == NUMSERVICES) {
+            printf("Unknown service %s in %s\n", name, path);
+            exit(1);
+        }
+        if (Services[svc].numReplicas == MAXREPLICAS) {
+            printf("Too many %s replicas in %s\n", name, path);
+            exit(1);
+        }
+
+        struct replica *rp = &Services[svc].replicas[Services[svc].numReplicas++];
+        snprintf(rp->name, sizeof(rp->name), "%s:%s", host, where);
+        if (strcmp(host, "unix") == 0) {
+            struct sockaddr_un *un = (struct sockaddr_un *) &rp->addr;
+            if (strlen(where) >= sizeof(un->sun_path)) {
+                printf("Socket path %s in %s is too long\n", where, path);
+                exit(1);
+            }
+            un->sun_family = AF_UNIX;
+            strcpy(un->sun_path, where);
+            rp->addrLen = sizeof(struct sockaddr_un);
+            continue;
+        }
+
+        struct sockaddr_in *in = (struct sockaddr_in *) &rp->addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(atoi(where));
+        rp->addrLen = sizeof(struct sockaddr_in);
+        if (inet_pton(AF_INET, host, &in->sin_addr) != 1) {
+            struct hostent *he = gethostbyname(host);
+            if (he == NULL) {
+                printf("Unknown host %s in %s\n", host, path);
+                exit(1);
+            }
+            memcpy(&in->sin_addr, he->h_addr_list[0], sizeof(in->sin_addr));
+        }
+    }
+    fclose(fp);
+
+    for (int svc = 0; svc < NUMSERVICES; svc++) {
+        if (Services[svc].numReplicas == 0) {
+            printf("No %s replicas in %s\n", ServiceNames[svc], path);
+            exit(1);
+        }
+        printf("Using %d %s replica(s)\n", Services[svc].numReplicas, ServiceNames[svc]);
+    }
+    return 0;
+}
+
+/* pickReplica()
+Chooses the replica of a service for the next attempt of a call, avoiding the one given (the replica of the
+previous attempt) when another is in rotation. A replica whose ejection has run out gets the next request as a
+probe, and *probe is set. Otherwise two random replicas in rotation are compared and the one with fewer requests
+in flight wins (power of two choices). If every replica is ejected, the one closest to re-admission is used.
+*/
+
+int pickReplica(int svc, int avoid, int *probe) {
+    struct service *sv = &Services[svc];
+    int inRotation[MAXREPLICAS];
+    int numInRotation = 0;
+    int soonest = -1;
+    long now = nowUs();
+
+    *probe = 0;
+    for (int r = 0; r < sv->numReplicas; r++) {
+        long until = __atomic_load_n(&sv->replicas[r].ejectedUntil, __ATOMIC_RELAXED);
+        if (until == 0) {
+            if (r != avoid) {
+                inRotation[numInRotation++] = r;
+            }
+            continue;
+        }
+
+        // Claim the probe by pushing the ejection back, so other sessions wait for its outcome
+        if (now >= until && r != avoid &&
+            __atomic_compare_exchange_n(&sv->replicas[r].ejectedUntil, &until, now + MAXRTO, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            *probe = 1;
+            return r;
+        }
+        if (soonest == -1 || until < sv->replicas[soonest].ejectedUntil) {
+            soonest = r;
+        }
+    }
+
+    if (numInRotation == 0) {
+        if (avoid >= 0 && __atomic_load_n(&sv->replicas[avoid].ejectedUntil, __ATOMIC_RELAXED) == 0) {
+            return avoid;
+        }
+        return soonest >= 0 ? soonest : 0;
+    }
+    if (numInRotation == 1) {
+        return inRotation[0];
+    }
+
+    int a = rand() % numInRotation;
+    int b = rand() % (numInRotation - 1);
+    if (b >= a) {
+        b++;
+    }
+    int loadA = __atomic_load_n(&sv->replicas[inRotation[a]].inflight, __ATOMIC_RELAXED);
+    int loadB = __atomic_load_n(&sv->replicas[inRotation[b]].inflight, __ATOMIC_RELAXED);
+    return loadA <= loadB ? inRotation[a] : inRotation[b];
+}
+
+/* replicaAnswered()
+Records a reply from a replica, clearing its timeouts and re-admitting it if it was ejected.
+*/
+
+int replicaAnswered(int svc, int r) {
+    struct replica *rp = &Services[svc].replicas[r];
+    __atomic_store_n(&rp->failures, 0, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&rp->ejectedUntil, 0, __ATOMIC_RELAXED) != 0) {
+        __atomic_store_n(&rp->ejections, 0, __ATOMIC_RELAXED);
+        printf("Readmitted %s replica %s\n", ServiceNames[svc], rp->name);
+    }
+    return 0;
+}
+
+/* replicaFailed()
+Records a timeout on a replica. After EJECTAFTER timeouts in a row, or a failed probe, the replica is taken out
+of rotation for EJECTUS, doubling with every ejection in a row up to MAXEJECTUS.
+*/
+
+int replicaFailed(int svc, int r, int probe) {
+    struct replica *rp = &Services[svc].replicas[r];
+    if (!probe) {
+        if (__atomic_load_n(&rp->ejectedUntil, __ATOMIC_RELAXED) != 0 ||
+            __atomic_add_fetch(&rp->failures, 1, __ATOMIC_RELAXED) < EJECTAFTER) {
+            return 0;
+        }
+    }
+
+    int ejections = __atomic_fetch_add(&rp->ejections, 1, __ATOMIC_RELAXED);
+    long ejectFor = EJECTUS;
+    while (ejections-- > 0 && ejectFor < MAXEJECTUS) {
+        ejectFor *= 2;
+    }
+    if (ejectFor > MAXEJECTUS) {
+        ejectFor = MAXEJECTUS;
+    }
+    __atomic_store_n(&rp->failures, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&rp->ejectedUntil, nowUs() + ejectFor, __ATOMIC_RELAXED);
+    printf("Ejected %s replica %s for %ld ms\n", ServiceNames[svc], rp->name, ejectFor / 1000);
+    return 0;
+}
+
+/* openUnixSocket()
+Creates this session's Unix-domain datagram socket if any replica is reached that way. It is autobound to a unique
+abstract name so the microservers have an address to reply to.
+*/
+
+int openUnixSocket() {
+    for (int svc = 0; svc < NUMSERVICES; svc++) {
+        for (int r = 0; r < Services[svc].numReplicas; r++) {
+            if (Services[svc].replicas[r].addr.ss_family != AF_UNIX) {
+                continue;
+            }
+            sa_family_t family = AF_UNIX;
+            if ((UnixSocket = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1 ||
+                bind(UnixSocket, (struct sockaddr *) &family, sizeof(family)) == -1) {
+                printf("Error creating Unix-domain socket\n");
+                exit(1);
+            }
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/* sendAttempt()
+Sends one attempt of a request to a replica of a microservice, tagged "@<call>.<attempt> ". Returns -1 if
+sending failed.
+*/
+
+int sendAttempt(int svc, int r, long call, int attempt, char *request) {
+    char tagged[MSGLEN + 32];
+    struct replica *rp = &Services[svc].replicas[r];
+    int sockfd = rp->addr.ss_family == AF_UNIX ? UnixSocket : ServiceSocket;
+    int len = snprintf(tagged, sizeof(tagged), "@%lx.%d %s", call, attempt, request);
+    if (sendto(sockfd, tagged, len, 0, (const struct sockaddr *) &rp->addr, rp->addrLen) == -1) {
+        __atomic_fetch_add(&MySlot->services[svc].sendFailures, 1, __ATOMIC_RELAXED);
+        printf("Failed to send to microserver.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* lockShared()
+Locks a process-shared mutex. The mutexes are robust, so a session that dies holding one (killed, or crashed)
+leaves it to the next locker instead of wedging every session; the state it guards is counts and flags that the
+callers tolerate being left half-updated, so it is simply marked consistent again.
+*/
+
+int lockShared(pthread_mutex_t *lock) {
+    if (pthread_mutex_lock(lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(lock);
+    }
+    return 0;
+}
+
+/* waitShared()
+Waits on a process-shared condition until ts, taking over the mutex like lockShared() if its owner died in the
+meantime. Returns what pthread_cond_timedwait() did otherwise.
+*/
+
+int waitShared(pthread_cond_t *cond, pthread_mutex_t *lock, struct timespec *ts) {
+    int result = pthread_cond_timedwait(cond, lock, ts);
+    if (result == EOWNERDEAD) {
+        pthread_mutex_consistent(lock);
+        return 0;
+    }
+    return result;
+}
+
+/* takeToken()
+Takes one request from a client IP's token bucket, which refills at Limiter->rate per second up to TOKENBURST.
+Returns 0 if the bucket was empty. Client IPs hashing to the same bucket share its tokens, so colliding clients
+cannot hand each other a full burst.
+*/
+
+int takeToken(in_addr_t ip) {
+    struct ip_bucket *b = &Limiter->buckets[(ip * 2654435761u) >> 22 & (IPBUCKETS - 1)];
+    long now = nowUs();
+    int taken = 0;
+
+    lockShared(&Limiter->lock);
+    if (b->refilledAt == 0) {
+        b->tokens = TOKENBURST * 1000L;
+    } else {
+        b->tokens += (now - b->refilledAt) * Limiter->rate / 1000;
+        if (b->tokens > TOKENBURST * 1000L) {
+            b->tokens = TOKENBURST * 1000L;
+        }
+    }
+    b->refilledAt = now;
+    if (b->tokens >= 1000) {
+        b->tokens -= 1000;
+        taken = 1;
+    }
+    pthread_mutex_unlock(&Limiter->lock);
+    return taken;
+}
+
+/* scheduleCalls()
+Admits waiting calls while the service has fewer than MAXINFLIGHT in progress. Each round of the deficit round
+robin credits every waiting session QUANTUM bytes, and a call is admitted once its session's credit covers the
+request, so sessions sending long requests cannot crowd out the others. A whole pass over the slots without a
+waiting call means the waiting count is stale, and ends the rounds. Called with the queue locked.
+*/
+
+int scheduleCalls(struct service_queue *q) {
+    int admitted = 0;
+    int idle = 0;
+    while (q->inflight < MAXINFLIGHT && q->waiting > 0) {
+        int s = q->next;
+        if (q->cost[s] == 0 && ++idle == MAXSLOTS) {
+            q->waiting = 0;
+            break;
+        }
+        if (q->cost[s] > 0) {
+            idle = 0;
+            q->deficit[s] += QUANTUM;
+            if (q->deficit[s] >= q->cost[s]) {
+                // A session waits on one call at a time, so its credit goes with it
+                q->cost[s] = 0;
+                q->deficit[s] = 0;
+                q->granted[s] = 1;
+                q->waiting--;
+                q->inflight++;
+                q->calls[s]++;
+                admitted = 1;
+            }
+        }
+        q->next = (s + 1) % MAXSLOTS;
+    }
+    if (admitted) {
+        pthread_cond_broadcast(&q->admitted);
+    }
+    return 0;
+}
+
+/* admitCall()
+Waits for a microservice to take another call from this session. A call is admitted at once while the service has
+fewer than MAXINFLIGHT in progress and nobody is waiting; otherwise it joins the service's queue. Returns -1 if the
+queue already holds QUEUELEN calls or the call was not admitted within QUEUEUS, so overload gets a quick answer
+instead of piling up retransmissions.
+*/
+
+int admitCall(int svc, int cost) {
+    struct service_queue *q = &Services[svc].queue;
+    int me = MySlot - Metrics->slots;
+
+    lockShared(&q->lock);
+    if (q->inflight < MAXINFLIGHT && q->waiting == 0) {
+        q->inflight++;
+        q->calls[me]++;
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+    if (q->waiting >= QUEUELEN) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+
+    q->cost[me] = cost > 0 ? cost : 1;
+    q->granted[me] = 0;
+    q->waiting++;
+    long until = nowUs() + QUEUEUS;
+    struct timespec ts = { until / 1000000, until % 1000000 * 1000 };
+    while (!q->granted[me]) {
+        if (waitShared(&q->admitted, &q->lock, &ts) == ETIMEDOUT && !q->granted[me]) {
+            q->cost[me] = 0;
+            q->deficit[me] = 0;
+            q->waiting--;
+            pthread_mutex_unlock(&q->lock);
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/* finishCall()
+Ends a call admitted by admitCall() and lets the next waiting call in.
+*/
+
+int finishCall(int svc) {
+    struct service_queue *q = &Services[svc].queue;
+    int me = MySlot - Metrics->slots;
+    lockShared(&q->lock);
+    q->inflight--;
+    q->calls[me]--;
+    scheduleCalls(q);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/* releaseSlot()
+Takes a session that has ended out of every service queue: its waiting call is dropped and its calls in flight
+no longer count against MAXINFLIGHT, so a session that dies while queued or in a call does not use up capacity
+for good.
+*/
+
+int releaseSlot(int slot) {
+    for (int svc = 0; svc < NUMSERVICES; svc++) {
+        struct service_queue *q = &Services[svc].queue;
+        lockShared(&q->lock);
+        if (q->cost[slot] > 0) {
+            q->cost[slot] = 0;
+            q->waiting--;
+        }
+        q->deficit[slot] = 0;
+        q->granted[slot] = 0;
+        q->inflight -= q->calls[slot];
+        q->calls[slot] = 0;
+        scheduleCalls(q);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return 0;
+}
+
+/* initAdmission()
+Maps the token buckets into memory shared with every session and sets up the process-shared, robust locks of the
+buckets and the service queues.
+*/
+
+int initAdmission(long rate) {
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+
+    Limiter = mmap(NULL, sizeof(struct rate_limiter), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Limiter == MAP_FAILED) {
+        printf("Could not map shared rate limits\n");
+        exit(1);
+    }
+    Limiter->rate = rate;
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&Limiter->lock, &mattr);
+    for (int svc = 0; svc < NUMSERVICES; svc++) {
+        pthread_mutex_init(&Services[svc].queue.lock, &mattr);
+        pthread_cond_init(&Services[svc].queue.admitted, &cattr);
+    }
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_destroy(&cattr);
+    return 0;
+}
+
+/* callService()
+Sends a request to a microservice and waits for the reply, which is copied (without its tag) into reply.
+Every request is safe to repeat (a ballot carries a token the voting service uses to spot repeats), so it is sent
+again when the retransmission timeout passes, up to MAXTRIES times with the timeout doubling each time, and with
+hedging on a duplicate is sent once the wait exceeds the service's 95th percentile round trip. Each attempt goes to
+a replica chosen by pickReplica(), and replicas that time out are reported to replicaFailed(). Replies to other
+calls are discarded. The call is first charged to the token bucket of client (unless it is OWNCALL) and admitted
+by the service's queue. Returns the reply length, -1 if the service did not answer, or BUSY if the call was not admitted.
+*/
+
+int callService(int svc, char *request, char *reply, in_addr_t client) {
+    static long calls = 0;
+    long call = ((long) getpid() << 20) + ++calls;
+    long sentAt[MAXTRIES + 1];
+    int sentTo[MAXTRIES + 1];
+    int probes[MAXTRIES + 1];
+    char msgIn[MSGLEN];
+    char prefix[32];
+    int attempts = 0;
+    int timedOut = 0;       // attempts already reported as timed out
+    int tries = 1;
+    int sendNow = 1;
+    int result = -1;
+    int hedged = !Hedging;
+
+    long rto = serviceRto(svc);
+    long hedgeAfter = 0;
+    long samples = __atomic_load_n(&Services[svc].rtt.samples, __ATOMIC_RELAXED);
+    if (samples >= HEDGESAMPLES) {
+        hedgeAfter = histPercentile(Services[svc].rtt.hist, samples, 95);
+    } else {
+        hedged = 1;
+    }
+
+    struct service_metrics *m = &MySlot->services[svc];
+    if ((client != OWNCALL && !takeToken(client)) || admitCall(svc, strlen(request)) == -1) {
+        __atomic_fetch_add(&m->busy, 1, __ATOMIC_RELAXED);
+        return BUSY;
+    }
+    __atomic_fetch_add(&m->calls, 1, __ATOMIC_RELAXED);
+    long start = nowUs();
+    long deadline = start + rto;
+    int prefixLen = sprintf(prefix, "@%lx.", call);
+
+    while (1) {
+        long now = nowUs();
+        if (sendNow) {
+            // Each attempt goes to a different replica than the one before, when there is one
+            int r = pickReplica(svc, attempts > 0 ? sentTo[attempts - 1] : -1, &probes[attempts]);
+            sentTo[attempts] = r;
+            sentAt[attempts] = now;
+            __atomic_fetch_add(&Services[svc].replicas[r].inflight, 1, __ATOMIC_RELAXED);
+            sendAttempt(svc, r, call, attempts++, request);
+            sendNow = 0;
+        }
+
+        long wake = deadline;
+        if (!hedged && sentAt[0] + hedgeAfter < wake) {
+            wake = sentAt[0] + hedgeAfter;
+        }
+
+        // Replies come back on the UDP socket or, from Unix-domain replicas, on UnixSocket (ignored while -1)
+        struct pollfd pfd[2] = {{ .fd = ServiceSocket, .events = POLLIN }, { .fd = UnixSocket, .events = POLLIN }};
+        struct timespec wait = { 0, 0 };
+        if (wake > now) {
+            wait.tv_sec = (wake - now) / 1000000;
+            wait.tv_nsec = (wake - now) % 1000000 * 1000;
+        }
+
+        if (ppoll(pfd, 2, &wait, NULL) > 0) {
+            int n = recv(pfd[0].revents & POLLIN ? ServiceSocket : UnixSocket, msgIn, MSGLEN - 1, MSG_DONTWAIT);
+            if (n <= 0) {
+                continue;
+            }
+            msgIn[n] = '\0';
+
+            // Only a reply to one of this call's attempts counts
+            char *body = strchr(msgIn, ' ');
+            if (strncmp(msgIn, prefix, prefixLen) != 0 || body == NULL) {
+                continue;
+            }
+            int attempt = atoi(msgIn + prefixLen);
+            if (attempt < 0 || attempt >= attempts) {
+                continue;
+            }
+            rttSample(svc, nowUs() - sentAt[attempt]);
+            replicaAnswered(svc, sentTo[attempt]);
+            __atomic_fetch_add(&m->hist[rttBucket(nowUs() - start)], 1, __ATOMIC_RELAXED);
+            bzero(reply, MSGLEN);
+            strcpy(reply, body + 1);
+            result = n - (body + 1 - msgIn);
+            break;
+        }
+
+        now = nowUs();
+        if (!hedged && now >= sentAt[0] + hedgeAfter && now < deadline) {
+            // Slower than usual - race a duplicate against the original
+            hedged = 1;
+            sendNow = 1;
+            __atomic_fetch_add(&m->hedges, 1, __ATOMIC_RELAXED);
+        } else if (now >= deadline) {
+            __atomic_fetch_add(&m->timeouts, attempts - timedOut, __ATOMIC_RELAXED);
+            for (; timedOut < attempts; timedOut++) {
+                replicaFailed(svc, sentTo[timedOut], probes[timedOut]);
+            }
+            if (tries == MAXTRIES) {
+                __atomic_fetch_add(&m->failures, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            // Retransmit with a doubled timeout
+            tries++;
+            __atomic_fetch_add(&m->retries, 1, __ATOMIC_RELAXED);
+            rto = rto * 2 > MAXRTO ? MAXRTO : rto * 2;
+            deadline = now + rto;
+            sendNow = 1;
+        }
+    }
+
+    for (int a = 0; a < attempts; a++) {
+        __atomic_fetch_sub(&Services[svc].replicas[sentTo[a]].inflight, 1, __ATOMIC_RELAXED);
+    }
+    finishCall(svc);
+    return result;
+}
+
+/* cacheKey()
+Writes the normalised form of a request into key: "t <word>" in lower case for translations, and "c <amount>
+<SOURCE> <DEST>" for conversions, mirroring how the microservers parse them. Returns -1 if the request is not
+cached (a vote, a malformed conversion or a key longer than KEYLEN).
+*/
+
+int cacheKey(int svc, char *request, char *key) {
+    char word[KEYLEN];
+    char source[KEYLEN];
+    char dest[KEYLEN];
+    int len;
+
+    if (svc == TRANSLATOR) {
+        len = snprintf(key, KEYLEN, "t %s", request);
+    } else if (svc == CONVERTER) {
+        if (sscanf(request, "%63s %63s %63s", word, source, dest) != 3) {
+            return -1;
+        }
+        dest[3] = '\0';
+        len = snprintf(key, KEYLEN, "c %.6f %s %s", atof(word), source, dest);
+    } else {
+        return -1;
+    }
+    if (len >= KEYLEN) {
+        return -1;
+    }
+    for (char *k = key; *k; k++) {
+        *k = tolower(*k);
+    }
+    return 0;
+}
+
+/* checkRates()
+Asks the converter for the version of its exchange rates once RATESTTL has passed since the last check. Cached
+conversions made with any other version are no longer used. Only one session makes the check at a time.
+*/
+
+int checkRates() {
+    char reply[MSGLEN];
+    long checkedAt = __atomic_load_n(&Cache->ratesCheckedAt, __ATOMIC_RELAXED);
+    long now = nowUs();
+
+    if (checkedAt != 0 && now < checkedAt + RATESTTL) {
+        return 0;
+    }
+    if (!__atomic_compare_exchange_n(&Cache->ratesCheckedAt, &checkedAt, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    long version = 0;
+    if (callService(CONVERTER, "rates", reply, OWNCALL) >= 0) {
+        version = atol(reply);
+    }
+    __atomic_store_n(&Cache->ratesVersion, version, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* cacheUsable()
+Returns 1 if a ready entry can answer a request. Translations never change; a conversion is only used while
+the converter still reports the rates it was made with.
+*/
+
+int cacheUsable(int svc, struct cache_entry *e) {
+    if (e->state != READY) {
+        return 0;
+    }
+    return svc == TRANSLATOR || e->ratesVersion == __atomic_load_n(&Cache->ratesVersion, __ATOMIC_RELAXED);
+}
+
+/* cachedCall()
+Answers a translation or conversion from the result cache, calling the microservice on a miss. Only one session
+calls the microservice for a key; others missing on the same key wait on the set until it is filled (or give up
+after FILLUS and call it themselves). Returns what callService() would.
+*/
+
+int cachedCall(int svc, char *request, char *reply) {
+    char key[KEYLEN];
+
+    if (svc == CONVERTER) {
+        checkRates();
+    }
+    long ratesVersion = __atomic_load_n(&Cache->ratesVersion, __ATOMIC_RELAXED);
+    if (cacheKey(svc, request, key) == -1 || (svc == CONVERTER && ratesVersion == 0)) {
+        return callService(svc, request, reply, ClientIp);
+    }
+
+    unsigned long h = 5381;
+    for (char *k = key; *k; k++) {
+        h = h * 33 + (unsigned char) *k;
+    }
+    struct cache_set *set = &Cache->sets[h & (CACHESETS - 1)];
+    struct cache_entry *e;
+    int waited = 0;
+
+    lockShared(&set->lock);
+    while (1) {
+        e = NULL;
+        for (int i = 0; i < CACHEWAYS; i++) {
+            if (set->entries[i].state != EMPTY && strcmp(set->entries[i].key, key) == 0) {
+                e = &set->entries[i];
+                break;
+            }
+        }
+
+        if (e != NULL && cacheUsable(svc, e)) {
+            e->lastUsed = __atomic_add_fetch(&Cache->clock, 1, __ATOMIC_RELAXED);
+            bzero(reply, MSGLEN);
+            memcpy(reply, e->value, e->valueLen);
+            int len = e->valueLen;
+            pthread_mutex_unlock(&set->lock);
+            __atomic_fetch_add(waited ? &Cache->coalesced : &Cache->hits, 1, __ATOMIC_RELAXED);
+            return len;
+        }
+
+        // Another session is asking the microservice already - wait for its answer
+        if (e != NULL && e->state == FILLING && nowUs() < e->fillingSince + FILLUS) {
+            long until = e->fillingSince + FILLUS;
+            struct timespec ts = { until / 1000000, until % 1000000 * 1000 };
+            waitShared(&set->filled, &set->lock, &ts);
+            waited = 1;
+            continue;
+        }
+        break;
+    }
+
+    // Claim an entry for this key: its own stale one, a free one, or the least recently used ready one
+    if (e == NULL) {
+        for (int i = 0; i < CACHEWAYS; i++) {
+            struct cache_entry *c = &set->entries[i];
+            if (c->state == FILLING) {
+                continue;
+            }
+            if (e == NULL || c->state == EMPTY || (e->state != EMPTY && c->lastUsed < e->lastUsed)) {
+                e = c;
+            }
+        }
+    }
+    if (e != NULL) {
+        strcpy(e->key, key);
+        e->state = FILLING;
+        e->fillingSince = nowUs();
+    }
+    pthread_mutex_unlock(&set->lock);
+    __atomic_fetch_add(&Cache->misses, 1, __ATOMIC_RELAXED);
+
+    int len = callService(svc, request, reply, ClientIp);
+    if (e == NULL) {
+        return len;
+    }
+
+    // Publish the reply (or free the entry if there was none) and wake the sessions waiting for it
+    lockShared(&set->lock);
+    if (e->state == FILLING && strcmp(e->key, key) == 0) {
+        if (len >= 0 && len < VALUELEN) {
+            memcpy(e->value, reply, len);
+            e->valueLen = len;
+            e->ratesVersion = ratesVersion;
+            e->lastUsed = __atomic_add_fetch(&Cache->clock, 1, __ATOMIC_RELAXED);
+            e->state = READY;
+        } else {
+            e->state = EMPTY;
+        }
+    }
+    pthread_cond_broadcast(&set->filled);
+    pthread_mutex_unlock(&set->lock);
+    return len;
+}
+
+/* initCache()
+Maps the result cache into memory shared with every session and sets up its process-shared, robust locks.
+*/
+
+int initCache() {
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+
+    Cache = mmap(NULL, sizeof(struct result_cache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Cache == MAP_FAILED) {
+        printf("Could not map shared cache\n");
+        exit(1);
+    }
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    for (int i = 0; i < CACHESETS; i++) {
+        pthread_mutex_init(&Cache->sets[i].lock, &mattr);
+        pthread_cond_init(&Cache->sets[i].filled, &cattr);
+    }
+    return 0;
+}
+
+/* formatStats()
+Adds up every slot's metrics and writes them into buf as "name value" lines: session counts and durations,
+then for each microservice its calls, send failures, timeouts, retries, hedges, failed calls and call latency
+percentiles in microseconds, then the result cache counters. Returns the length written.
+*/
+
+int formatStats(char *buf, int cap) {
+    struct session_metrics total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < MAXSLOTS; i++) {
+        struct session_metrics *slot = &Metrics->slots[i];
+        total.started += __atomic_load_n(&slot->started, __ATOMIC_RELAXED);
+        total.ended += __atomic_load_n(&slot->ended, __ATOMIC_RELAXED);
+        for (int b = 0; b < RTTBUCKETS; b++) {
+            total.hist[b] += __atomic_load_n(&slot->hist[b], __ATOMIC_RELAXED);
+        }
+        for (int svc = 0; svc < NUMSERVICES; svc++) {
+            struct service_metrics *from = &slot->services[svc];
+            struct service_metrics *to = &total.services[svc];
+            to->calls += __atomic_load_n(&from->calls, __ATOMIC_RELAXED);
+            to->sendFailures += __atomic_load_n(&from->sendFailures, __ATOMIC_RELAXED);
+            to->timeouts += __atomic_load_n(&from->timeouts, __ATOMIC_RELAXED);
+            to->retries += __atomic_load_n(&from->retries, __ATOMIC_RELAXED);
+            to->hedges += __atomic_load_n(&from->hedges, __ATOMIC_RELAXED);
+            to->failures += __atomic_load_n(&from->failures, __ATOMIC_RELAXED);
+            to->busy += __atomic_load_n(&from->busy, __ATOMIC_RELAXED);
+            for (int b = 0; b < RTTBUCKETS; b++) {
+                to->hist[b] += __atomic_load_n(&from->hist[b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    int len = snprintf(buf, cap, "time %ld\nsessions_started %ld\nsessions_active %d\nsessions_ended %ld\n"
+                       "sessions_refused %ld\n", (long) time(NULL), total.started,
+                       __atomic_load_n(&Metrics->active, __ATOMIC_RELAXED), total.ended,
+                       __atomic_load_n(&Metrics->refused, __ATOMIC_RELAXED));
+    if (total.ended > 0) {
+        len += snprintf(buf + len, cap - len, "session_p50_us %ld\nsession_p99_us %ld\n",
+                        histPercentile(total.hist, total.ended, 50), histPercentile(total.hist, total.ended, 99));
+    }
+
+    for (int svc = 0; svc < NUMSERVICES; svc++) {
+        struct service_metrics *m = &total.services[svc];
+        char *name = ServiceNames[svc];
+        len += snprintf(buf + len, cap - len, "%s_calls %ld\n%s_send_failures %ld\n%s_timeouts %ld\n%s_retries %ld\n"
+                        "%s_hedges %ld\n%s_failures %ld\n%s_busy %ld\n", name, m->calls, name, m->sendFailures,
+                        name, m->timeouts, name, m->retries, name, m->hedges, name, m->failures, name, m->busy);
+        long answered = m->calls - m->failures;
+        if (answered > 0) {
+            len += snprintf(buf + len, cap - len, "%s_p50_us %ld\n%s_p90_us %ld\n%s_p99_us %ld\n",
+                            name, histPercentile(m->hist, answered, 50), name, histPercentile(m->hist, answered, 90),
+                            name, histPercentile(m->hist, answered, 99));
+        }
+    }
+
+    len += snprintf(buf + len, cap - len, "cache_hits %ld\ncache_misses %ld\ncache_coalesced %ld\n",
+                    __atomic_load_n(&Cache->hits, __ATOMIC_RELAXED), __atomic_load_n(&Cache->misses, __ATOMIC_RELAXED),
+                    __atomic_load_n(&Cache->coalesced, __ATOMIC_RELAXED));
+    return len < cap ? len : cap - 1;
+}
+
+/* statsDumper()
+Runs in a process of its own, writing the metrics to STATSFILE every interval seconds. The file is replaced
+with a rename, so a reader never sees half a dump. Exits with the listener.
+*/
+
+int statsDumper(int interval) {
+    char buf[MSGLEN];
+    char tmp[64];
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    sprintf(tmp, "%s.tmp", STATSFILE);
+    while (1) {
+        sleep(interval);
+        int len = formatStats(buf, MSGLEN);
+        FILE *f = fopen(tmp, "w");
+        if (f == NULL) {
+            printf("Could not write %s\n", tmp);
+            continue;
+        }
+        fwrite(buf, 1, len, f);
+        fclose(f);
+        rename(tmp, STATSFILE);
+    }
+    return 0;
+}
+
+/* childEnded()
+SIGCHLD handler. Only wakes the listener through ReapPipe: reaping takes the service queue locks, which must not
+be taken inside a signal handler.
+*/
+
+void childEnded(int sig) {
+    (void) sig;
+    int saved = errno;
+    ssize_t n = write(ReapPipe[1], "", 1);  // a full pipe means the listener is woken already
+    (void) n;
+    errno = saved;
+}
+
+/* reapSessions()
+Run by the listener when ReapPipe wakes it. Collects finished session processes, frees their metrics slots and
+releases their places in the service queues.
+*/
+
+void reapSessions() {
+    char drain[64];
+    while (read(ReapPipe[0], drain, sizeof(drain)) > 0) {
+    }
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        if (pid == DumperPid) {
+            continue;
+        }
+        __atomic_fetch_sub(&Metrics->active, 1, __ATOMIC_RELAXED);
+        for (int i = 0; i < MAXSLOTS; i++) {
+            if (Metrics->slotPids[i] == pid) {
+                releaseSlot(i);
+                Metrics->slotPids[i] = 0;
+                break;
+            }
+        }
+    }
+}
 
 /* Main program for interserver
 Implements the interserver functionality by creating a UDP socket for communication with the microservers and
@@ -34,7 +1203,7 @@ a TCP connection with a client. It enters into a loop prompting the client for a
 information back and forth between the client and the microservers.
 */
 
-int main() {
+int main(int argc, char *argv[]) {
 
     char msgIn[MSGLEN];
     char msgOut[MSGLEN];
@@ -47,42 +1216,79 @@ int main() {
     char *source;
     char *dest;
     char msg[MSGLEN];
-    int voted = 0;
-    int key;
     int clientVote;
+    char token[24];
+    int opt;
 
+    char *config = CONFIGFILE;
+    int statsEvery = STATSEVERY;
+    int maxSessions = MAXSLOTS;
+    long tokenRate = TOKENRATE;
+    int result;
 
-    struct sockaddr_in server, clientAddr, mServer;
-    int client, serverSocket, clientSocket, pid, num;
-
-    // timeval struct for setting socket timers
-    struct timeval timeout;
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
+    while ((opt = getopt(argc, argv, "hc:s:m:r:")) != -1) {
+        if (opt == 'h') {
+            Hedging = 1;
+        } else if (opt == 'c') {
+            config = optarg;
+        } else if (opt == 's') {
+            statsEvery = atoi(optarg);
+        } else if (opt == 'm') {
+            maxSessions = atoi(optarg);
+        } else if (opt == 'r') {
+            tokenRate = atol(optarg);
+        } else {
+            printf("Usage: %s [-h] [-c config] [-s stats interval] [-m max sessions] [-r requests per second per IP]\n", argv[0]);
+            exit(1);
+        }
+    }
 
-    /* Create the UPD socket */
+    struct sockaddr_in server, clientAddr;
+    int client, serverSocket, pid;
 
     memset(&clientAddr,0,sizeof(clientAddr));
     socklen_t cLen = sizeof(clientAddr);
 
-    // Initialize server sockaddr structure
-    memset(&mServer, 0, sizeof(mServer));
-    mServer.sin_family = AF_INET;
-    inet_pton(AF_INET,"136.159.5.25",&mServer.sin_addr);
-    socklen_t len = sizeof(mServer);
-
-    // Create socket for communicating with microservers
-    if((clientSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
-        printf("Error creating socket\n");
+    // Replicas and round-trip statistics live in memory shared with every session process
+    Services = mmap(NULL, NUMSERVICES * sizeof(struct service), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Services == MAP_FAILED) {
+        printf("Could not map shared statistics\n");
+        exit(1);
+    }
+
+    // Read the microserver replicas
+    loadConfig(config);
+    initCache();
+    initAdmission(tokenRate);
+    if (maxSessions < 1 || maxSessions > MAXSLOTS) {
+        maxSessions = MAXSLOTS;
+    }
+
+    // Metrics are written by the sessions and read by the stats command and the dumper
+    Metrics = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Metrics == MAP_FAILED) {
+        printf("Could not map shared metrics\n");
         exit(1);
     }
+    MySlot = &Metrics->slots[0];
 
-    // Set the timer for UDP connections at 1 second
-    if(setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval)) == -1) {
-        printf("Setsockopt failed\n");
+    if (pipe(ReapPipe) == -1) {
+        printf("Could not create the reaping pipe\n");
         exit(1);
     }
+    fcntl(ReapPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(ReapPipe[1], F_SETFL, O_NONBLOCK);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = childEnded;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
 
+    if (statsEvery > 0) {
+        if ((DumperPid = fork()) == 0) {
+            statsDumper(statsEvery);
+        }
+    }
 
     /* Connect to telnet client */
 
@@ -105,18 +1311,44 @@ int main() {
     }
 
     // start listening for incoming connections from clients
-    if(listen(serverSocket, 5) == -1 ) {
+    if(listen(serverSocket, BACKLOG) == -1 ) {
 	    fprintf(stderr, "Server listen() call failed\n");
 	    exit(1);
     }
 
     printf("Listening for clients on port %d...\n", CLIENTPORTNUM);
 
-    // Loop forever listening for clients and forking upon connection
+    // Loop forever listening for clients and forking upon connection, reaping finished sessions in between
+    struct pollfd waitFor[2] = { { serverSocket, POLLIN, 0 }, { ReapPipe[0], POLLIN, 0 } };
     while (1) {
 
+        if (poll(waitFor, 2, -1) == -1) {
+            continue;
+        }
+        if (waitFor[1].revents & POLLIN) {
+            reapSessions();
+        }
+        if (!(waitFor[0].revents & POLLIN)) {
+            continue;
+        }
+
         if((client = accept(serverSocket, (struct sockaddr*)&clientAddr, &cLen)) != -1 ) {
 
+            // Give the session a metrics slot of its own, or turn it away at once if the server is full or the
+            // client IP is connecting too often
+            int slot = 0;
+            while (slot < MAXSLOTS && Metrics->slotPids[slot] != 0) {
+                slot++;
+            }
+            if (slot == MAXSLOTS || Metrics->active >= maxSessions || !takeToken(clientAddr.sin_addr.s_addr)) {
+                strcpy(msgOut, "\nThe server is busy right now. Please try again in a moment.\n");
+                send(client, msgOut, strlen(msgOut), MSG_DONTWAIT);
+                close(client);
+                __atomic_fetch_add(&Metrics->refused, 1, __ATOMIC_RELAXED);
+                bzero(msgOut, MSGLEN);
+                continue;
+            }
+
             pid = fork();
 
             if(pid < 0) {
@@ -127,11 +1359,26 @@ int main() {
             // Child process deals with client
             else if (pid == 0) {
 
+                close(ReapPipe[0]);
+                close(ReapPipe[1]);
+                MySlot = &Metrics->slots[slot];
+                __atomic_fetch_add(&MySlot->started, 1, __ATOMIC_RELAXED);
+                long sessionStart = nowUs();
+
                 // Get client's IP address
                 char * clientIP = inet_ntoa(clientAddr.sin_addr);
+                ClientIp = clientAddr.sin_addr.s_addr;
+                srand(time(NULL) ^ getpid());
 
                 close(serverSocket);
 
+                // Create this session's own socket for communicating with microservers
+                if((ServiceSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+                    printf("Error creating socket\n");
+                    exit(1);
+                }
+                openUnixSocket();
+
                 // Present menu
                 strcpy(msgOut, "\nWelcome! We have three services for you:\n1. An English-French translator (command <translate>)\n2. A currency converter (command <convert>)\n3. A voting service (command <vote>)\n\nPlease make your selection.\n>> ");
                 send(client, msgOut, MSGLEN, 0);
@@ -144,8 +1391,14 @@ int main() {
                 while ((strcasecmp(command, "translate") != 0) && (strcasecmp(command, "convert") != 0) && (strcasecmp(command, "vote") != 0)) {
                     bzero(msgIn, MSGLEN);
                     bzero(msgOut, MSGLEN);
+                    if (strcasecmp(command, "stats") == 0) {
+                        // Hidden command showing the interserver's metrics
+                        int len = formatStats(msgOut, MSGLEN - 4);
+                        strcpy(msgOut + len, "\n>> ");
+                    } else {
+                        strcpy(msgOut,"Please enter a valid command (translate, convert, or vote)\n>> ");
+                    }
                     bzero(command, 20);
-                    strcpy(msgOut,"Please enter a valid command (translate, convert, or vote)\n>> ");
                     send(client, msgOut, MSGLEN, 0);
                     recv(client, msgIn, MSGLEN, 0);
                     c = strtok(msgIn, "\r\n");
@@ -171,14 +1424,7 @@ int main() {
                         printf("Client chose to convert %s to French\n", word);
 
                         // Send word to microserver and receive response
-                        mServer.sin_port = htons(MSERVER1);
-                        if(sendto(clientSocket, word, sizeof(word), 0, (const struct sockaddr *) &mServer, sizeof(mServer)) < 0) {
-                            bzero(msgOut, MSGLEN);
-                            strcpy(msgOut, "This service is temporarily unavailable. Please try again later.\n");
-                            send(client, msgOut, MSGLEN, 0);
-                            printf("Failed to send to microserver.\n");
-                        }
-                        if(recvfrom(clientSocket, msgIn, MSGLEN, MSG_WAITALL, (struct sockaddr*)&mServer, &len) > 0) {
+                        if((result = cachedCall(TRANSLATOR, word, msgIn)) >= 0) {
 
                             // UDP worked - send response back to client
                             printf("Received response from translator: %s\nForwarding to client...\n", msgIn);
@@ -189,7 +1435,7 @@ int main() {
                             send(client, msgOut, MSGLEN, 0);
                         } else {
                             bzero(msgOut, MSGLEN);
-                            strcpy(msgOut, "This service is temporarily unavailable. Please try again later.\n");
+                            strcpy(msgOut, result == BUSY ? BUSYMSG : UNAVAILABLEMSG);
                             send(client, msgOut, MSGLEN, 0);
                             printf("Failed to receive from microserver.\n");
                         }
@@ -209,35 +1455,26 @@ int main() {
                         printf("Client requested %s\n", msgOut);
 
                         // Send input to microserver
-                        mServer.sin_port = htons(MSERVER2);
                         bzero(msgIn, MSGLEN);
-                        if(sendto(clientSocket, msgOut, sizeof(msgOut), 0, (const struct sockaddr *) &mServer, sizeof(mServer)) == -1) {
+                        if ((result = cachedCall(CONVERTER, msgOut, msgIn)) >= 0) {
+
+                            // UDP worked - send response back to client
+                            c = strtok(msg, " ");
+                            value = c;
+                            c = strtok(NULL, " ");
+                            source = c;
+                            c = strtok(NULL, " ");
+                            dest = c;
+
+                            printf("Received response from currency converter: %s\nForwarding to client...\n", msgIn);
                             bzero(msgOut, MSGLEN);
-                            strcpy(msgOut, "This service is temporarily unavailable. Please try again later.\n");
+                            sprintf(msgOut, "%s %s is %s %s\n", value, source, msgIn, dest);
                             send(client, msgOut, MSGLEN, 0);
-                            printf("Failed to send to microserver.\n");
                         } else {
-                            if (recvfrom(clientSocket, msgIn, MSGLEN, MSG_WAITALL, (struct sockaddr*)&mServer, &len) != -1) {
-
-                                // UDP worked - send response back to client
-                                c = strtok(msg, " ");
-                                value = c;
-                                c = strtok(NULL, " ");
-                                source = c;
-                                c = strtok(NULL, " ");
-                                dest = c;
-                                
-                                printf("Received response from currency converter: %s\nForwarding to client...\n", msgIn);
-                                bzero(msgOut, MSGLEN);
-                                sprintf(msgOut, "%s %s is %s %s\n", value, source, msgIn, dest);
-                                send(client, msgOut, MSGLEN, 0);
-                            } else {
-                                bzero(msgOut, MSGLEN);
-                                strcpy(msgOut, "This service is temporarily unavailable. Please try again later.\n");
-                                send(client, msgOut, MSGLEN, 0);
-                                printf("Failed to receive from microserver.\n");
-                            }
-                            
+                            bzero(msgOut, MSGLEN);
+                            strcpy(msgOut, result == BUSY ? BUSYMSG : UNAVAILABLEMSG);
+                            send(client, msgOut, MSGLEN, 0);
+                            printf("Failed to receive from microserver.\n");
                         }
 
                     }
@@ -255,8 +1492,6 @@ int main() {
                         strcpy(msg, c);
                         printf("Client requested %s\n", msg);
 
-                        // Send client command and IP address to microserver
-                        mServer.sin_port = htons(MSERVER3);
                         bzero(msgIn, MSGLEN);
 
                         // Loop within the voting service until client chooses to exit
@@ -265,17 +1500,14 @@ int main() {
                             bzero(msgOut, MSGLEN);
                             sprintf(msgOut, "%s %s", msg, clientIP);
                             bzero(msgIn, MSGLEN);
+                            int answered = 1;
 
-                            // Send command and IP address to microserver
-                            if(sendto(clientSocket, msgOut, sizeof(msgOut), 0, (const struct sockaddr *) &mServer, sizeof(mServer)) == -1) {
-                                bzero(msgOut, MSGLEN);
-                                strcpy(msgOut, "This service is temporarily unavailable. Please try again later.\n");
-                                send(client, msgOut, MSGLEN, 0);
-                                printf("Failed to send to microserver.\n");
-                            } else {
-                                if (recvfrom(clientSocket, msgIn, MSGLEN, MSG_WAITALL, (struct sockaddr*)&mServer, &len) == -1) {
+                            // Send command and IP address to microserver (votes are sent below as one ballot)
+                            if (strstr(msg, "vote") == NULL) {
+                                if ((result = callService(VOTING, msgOut, msgIn, ClientIp)) < 0) {
+                                    answered = 0;
                                     bzero(msgOut, MSGLEN);
-                                    strcpy(msgOut, "This service is temporarily unavailable. Please try again later.\n");
+                                    strcpy(msgOut, result == BUSY ? BUSYMSG : UNAVAILABLEMSG);
                                     send(client, msgOut, MSGLEN, 0);
                                     printf("Failed to receive from microserver.\n");
                                 }
@@ -284,7 +1516,7 @@ int main() {
                             // Next steps depend on client command
 
                             // Client requested show
-                            if(strstr(msg, "show") != NULL) {
+                            if(answered && strstr(msg, "show") != NULL) {
                                 printf("Received list of candidates, forwarding to client...\n", msgIn);
                                 bzero(msgOut, MSGLEN);
                                 strcpy(msgOut, msgIn);
@@ -293,53 +1525,40 @@ int main() {
                             
                             // Client requested vote
                             else if(strstr(msg, "vote") != NULL) {
-                                // Microserver response is "N" if user has voted already
-                                if (strcmp(msgIn, "N") == 0) {
+                                // Get candidate ID from client
+                                bzero(msgOut, MSGLEN);
+                                strcpy(msgOut, "Enter the ID of the candidate you would like to vote for: ");
+                                send(client, msgOut, MSGLEN, 0);
+                                bzero(msgIn, MSGLEN);
+                                recv(client, msgIn, MSGLEN, 0);
+                                clientVote = atoi(msgIn);
+
+                                // Cast the vote in one round trip; the token lets the microserver spot retries
+                                sprintf(token, "%x%08x%04x", (unsigned) getpid(), (unsigned) time(NULL), rand() & 0xffff);
+                                bzero(msgOut, MSGLEN);
+                                sprintf(msgOut, "ballot %s %d %s", clientIP, clientVote, token);
+                                if ((result = callService(VOTING, msgOut, msgIn, ClientIp)) < 0) {
+                                    bzero(msgOut, MSGLEN);
+                                    strcpy(msgOut, result == BUSY ? BUSYMSG : UNAVAILABLEMSG);
+                                    send(client, msgOut, MSGLEN, 0);
+                                    printf("Failed to receive from microserver.\n");
+                                } else if (strcmp(msgIn, "N") == 0) {
+                                    // Microserver response is "N" if user has voted already
                                     printf("This client has already voted\n");
                                     bzero(msgOut, MSGLEN);
                                     strcpy(msgOut, "You can only vote once.\n");
                                     send(client, msgOut, MSGLEN, 0);
+                                } else if (strcmp(msgIn, "vote counted") == 0) {
+                                    printf("Vote counted\n");
                                 } else {
-                                    // Microserver returns encryption key...get candidate ID from client
-                                    printf("Encryption key is %s\n", msgIn);
-                                    key = atoi(msgIn);
-                                    strcpy(msgOut, "Enter the ID of the candidate you would like to vote for: ");
-                                    send(client, msgOut, MSGLEN, 0);
-                                    bzero(msgIn, MSGLEN);
+                                    printf("Vote not counted\n");
                                     bzero(msgOut, MSGLEN);
-                                    recv(client, msgIn, MSGLEN, 0);
-                                    clientVote = atoi(msgIn);
-                                    clientVote = clientVote * key;
-                                    sprintf(msgOut, "%d", clientVote);
-
-                                    // Send encrypted vote to microserver
-                                    if(sendto(clientSocket, msgOut, sizeof(msgOut), 0, (const struct sockaddr *) &mServer, sizeof(mServer)) == -1) {
-                                        bzero(msgOut, MSGLEN);
-                                        strcpy(msgOut, "This service is temporarily unavailable. Please try again later.\n");
-                                        send(client, msgOut, MSGLEN, 0);
-                                        printf("Failed to send to microserver.\n");
-                                    } else {
-                                        if (recvfrom(clientSocket, msgIn, MSGLEN, MSG_WAITALL, (struct sockaddr*)&mServer, &len) == -1) {
-                                            bzero(msgOut, MSGLEN);
-                                            strcpy(msgOut, "This service is temporarily unavailable. Please try again later.\n");
-                                            send(client, msgOut, MSGLEN, 0);
-                                            printf("Failed to receive from microserver.\n");
-                                        } else {
-                                            // Vote counted or not
-                                            if(strcmp(msgIn, "vote counted") == 0) {
-                                                printf("Vote counted\n");
-                                            } else {
-                                                printf("Vote not counted\n");
-                                                bzero(msgOut, MSGLEN);
-                                                strcpy(msgOut, "Your vote could not be processed. Please try again later.\n");
-                                                send(client, msgOut, MSGLEN, 0);
-                                            }
-                                        }
-                                    }
+                                    strcpy(msgOut, "Your vote could not be processed. Please try again later.\n");
+                                    send(client, msgOut, MSGLEN, 0);
                                 }
 
                             // Client requested summary
-                            } else if(strstr(msg, "summary") != NULL) {
+                            } else if(answered && strstr(msg, "summary") != NULL) {
                                 if(strcmp(msgIn, "N") == 0) {
                                     // Client can't see summary yet
                                     strcpy(msgOut, "You can't see the election results until you have voted\n");
@@ -379,8 +1598,14 @@ int main() {
                     while ((strcasecmp(command, "translate") != 0) && (strcasecmp(command, "convert") != 0) && (strcasecmp(command, "vote") != 0) && (strcasecmp(command, "exit") != 0)) {
                         bzero(msgIn, MSGLEN);
                         bzero(msgOut, MSGLEN);
+                        if (strcasecmp(command, "stats") == 0) {
+                            // Hidden command showing the interserver's metrics
+                            int len = formatStats(msgOut, MSGLEN - 4);
+                            strcpy(msgOut + len, "\n>> ");
+                        } else {
+                            strcpy(msgOut,"Please enter a valid command (translate, convert, vote, or exit)\n>> ");
+                        }
                         bzero(command, 20);
-                        strcpy(msgOut,"Please enter a valid command (translate, convert, vote, or exit)\n>> ");
                         send(client, msgOut, MSGLEN, 0);
                         recv(client, msgIn, MSGLEN, 0);
                         c = strtok(msgIn, "\r\n");
@@ -388,6 +1613,8 @@ int main() {
                     }
                 }
 
+                __atomic_fetch_add(&MySlot->hist[rttBucket(nowUs() - sessionStart)], 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&MySlot->ended, 1, __ATOMIC_RELAXED);
                 strcpy(msgOut, "Thank you for your time.\n");
                 send(client, msgOut, MSGLEN, 0);
                 close(client);
@@ -395,6 +1622,8 @@ int main() {
             }
 
             else if (pid > 0) {
+                Metrics->slotPids[slot] = pid;
+                __atomic_fetch_add(&Metrics->active, 1, __ATOMIC_RELAXED);
                 close(client);
             }
             
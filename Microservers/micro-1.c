@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -5,80 +6,381 @@
 #include <signal.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <arpa/inet.h> 
+#include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 
 #define PORTNUM 8725
 #define MSGLEN 3000
+#define MAXWORKERS 64
+#define BATCH 64            // most datagrams read or answered by one system call
+#define TAGLEN 24           // longest request tag echoed back to the client
 
-/* Main program for translator
-Implements the functionality of the English-French translator. Creates a UDP socket and listens for data, then reads it in 
-the format "word". Translates the word, then sends back the French equivalent to the client.
+// Dictionary
+#define DICTFILE "dictionary.txt"
+#define MAXWORDS 256
+#define WORDLEN 32
+
+// Print a line for every request only when started with -v
+#define LOG(...) do { if (Verbose) printf(__VA_ARGS__); } while (0)
+
+// English words and their French translations
+struct dictionary {
+    int numWords;
+    char english[MAXWORDS][WORDLEN];
+    char french[MAXWORDS][WORDLEN];
+};
+
+// A worker thread with its own socket and its own copy of the dictionary
+struct worker {
+    pthread_t thread;
+    int sockfd;
+    int unixfd;                     // Unix-domain socket served by this worker, or -1
+    int cpu;                        // CPU the worker is pinned to, or -1
+    struct dictionary *dict;        // only read and freed by the worker
+    struct dictionary *pending;     // a reloaded copy, swapped in before the next batch
+    char (*msgIn)[MSGLEN];
+    char (*msgOut)[MSGLEN];
+};
+
+struct worker Workers[MAXWORKERS];
+int NumWorkers = 1;
+char *DictFile = DICTFILE;
+int Verbose = 0;
+
+/* splitTag()
+Requests may start with a tag of the form "@<id> " which is echoed at the start of the reply, so the client
+can match replies to retransmitted requests. Copies the tag into reply and returns its length (0 if untagged).
 */
 
-int main() {
+int splitTag(char *msg, char *reply) {
+    if (msg[0] != '@') {
+        return 0;
+    }
+    int len = strcspn(msg, " ");
+    if (msg[len] != ' ' || len > TAGLEN) {
+        return 0;
+    }
+    memcpy(reply, msg, len + 1);
+    return len + 1;
+}
 
-    // Create UDP socket
-    int sockfd = socket(AF_INET,SOCK_DGRAM,IPPROTO_UDP);
-    if (sockfd == -1) {
-        printf("Socket() call failed\n");
-        exit(1);
+/* loadDictionary()
+Reads a dictionary from a file with one "<English word> <French translation>" line per word, where the translation
+is the rest of the line. Lines starting with # are comments. Returns a new dictionary, or NULL if the file cannot
+be read or has no words.
+*/
+
+struct dictionary *loadDictionary(char *path) {
+    char line[2 * WORDLEN + 8];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        printf("Could not open dictionary file %s\n", path);
+        return NULL;
     }
 
-    struct sockaddr_in sock;
-    memset(&sock,0,sizeof(sock));
-    sock.sin_family = AF_INET;
-    sock.sin_port = htons(PORTNUM);
-    sock.sin_addr.s_addr = INADDR_ANY;
+    struct dictionary *dict = calloc(1, sizeof(struct dictionary));
+    while (fgets(line, sizeof(line), f) != NULL && dict->numWords < MAXWORDS) {
+        char english[WORDLEN];
+        int frenchAt;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || sscanf(line, "%31s %n", english, &frenchAt) != 1 || line[frenchAt] == '\0') {
+            continue;
+        }
+        strcpy(dict->english[dict->numWords], english);
+        snprintf(dict->french[dict->numWords], WORDLEN, "%s", line + frenchAt);
+        dict->numWords++;
+    }
+    fclose(f);
+
+    if (dict->numWords == 0) {
+        printf("No words in %s\n", path);
+        free(dict);
+        return NULL;
+    }
+    return dict;
+}
+
+/* reloader()
+Thread that rereads the dictionary file on SIGHUP. Every worker gets a copy of its own, handed over by swapping
+its pending pointer; a copy the worker has not picked up yet is freed here, and the worker frees the one it
+replaces, so no worker ever reads memory another thread may free.
+*/
+
+void *reloader(void *arg) {
+    sigset_t *hup = arg;
+    int sig;
+
+    while (sigwait(hup, &sig) == 0) {
+        struct dictionary *dict = loadDictionary(DictFile);
+        if (dict == NULL) {
+            printf("Keeping the old dictionary\n");
+            continue;
+        }
+        for (int i = 0; i < NumWorkers; i++) {
+            struct dictionary *copy = malloc(sizeof(struct dictionary));
+            memcpy(copy, dict, sizeof(struct dictionary));
+            free(__atomic_exchange_n(&Workers[i].pending, copy, __ATOMIC_ACQ_REL));
+        }
+        printf("Reloaded %d words from %s\n", dict->numWords, DictFile);
+        free(dict);
+    }
+    return NULL;
+}
+
+/* translate()
+Translates an English word to French, writing the French word (or "Undefined") into reply. Returns its length.
+*/
+
+int translate(struct dictionary *dict, char *word, char *reply) {
+    for (int i = 0; i < dict->numWords; i++) {
+        if (strcasecmp(word, dict->english[i]) == 0) {
+            strcpy(reply, dict->french[i]);
+            return strlen(reply);
+        }
+    }
+    strcpy(reply, "Undefined");
+    return strlen(reply);
+}
+
+/* serveBatch()
+Reads up to BATCH waiting words from sockfd with one recvmmsg(), translates them and sends the translations
+back with one sendmmsg(). With MSG_WAITFORONE it blocks for the first request.
+*/
+
+int serveBatch(struct worker *w, int sockfd, int flags) {
+
+    // One buffer, client address and message header per request in a batch
+    char (*msgIn)[MSGLEN] = w->msgIn;
+    char (*msgOut)[MSGLEN] = w->msgOut;
+    struct sockaddr_storage clients[BATCH];
+    struct iovec inVecs[BATCH], outVecs[BATCH];
+    struct mmsghdr inMsgs[BATCH], outMsgs[BATCH];
+
+    memset(inMsgs, 0, sizeof(inMsgs));
+    memset(outMsgs, 0, sizeof(outMsgs));
+    for (int i = 0; i < BATCH; i++) {
+        inVecs[i].iov_base = msgIn[i];
+        inVecs[i].iov_len = MSGLEN - 1;
+        inMsgs[i].msg_hdr.msg_iov = &inVecs[i];
+        inMsgs[i].msg_hdr.msg_iovlen = 1;
+        inMsgs[i].msg_hdr.msg_name = &clients[i];
+        inMsgs[i].msg_hdr.msg_namelen = sizeof(clients[i]);
+        outVecs[i].iov_base = msgOut[i];
+        outMsgs[i].msg_hdr.msg_iov = &outVecs[i];
+        outMsgs[i].msg_hdr.msg_iovlen = 1;
+        outMsgs[i].msg_hdr.msg_name = &clients[i];
+    }
+
+    int n = recvmmsg(sockfd, inMsgs, BATCH, flags, NULL);
+    if (n <= 0) {
+        return 0;
+    }
+
+    // Take up a reloaded dictionary between batches
+    struct dictionary *fresh = __atomic_exchange_n(&w->pending, NULL, __ATOMIC_ACQ_REL);
+    if (fresh != NULL) {
+        free(w->dict);
+        w->dict = fresh;
+    }
+
+    // Translate each input word
+    for (int i = 0; i < n; i++) {
+        msgIn[i][inMsgs[i].msg_len] = '\0';
+        int tagLen = splitTag(msgIn[i], msgOut[i]);
+        LOG("Translating %s...\n", msgIn[i] + tagLen);
+        outVecs[i].iov_len = tagLen + translate(w->dict, msgIn[i] + tagLen, msgOut[i] + tagLen);
+        outMsgs[i].msg_hdr.msg_namelen = inMsgs[i].msg_hdr.msg_namelen;
+    }
 
-    if(bind(sockfd,(struct sockaddr*)&sock,sizeof(sock)) == -1) {
-        printf("Bind() call failed\n");
+    // Send responses back
+    for (int sent = 0; sent < n; ) {
+        int m = sendmmsg(sockfd, outMsgs + sent, n - sent, 0);
+        if (m <= 0) {
+            break;
+        }
+        sent += m;
+    }
+
+    LOG("%d translations sent back\n", n);
+    return n;
+}
+
+/* bindUnix()
+Creates a Unix-domain datagram socket at the given path, for an interserver on the same host, and returns it.
+*/
+
+int bindUnix(char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s is too long\n", path);
         exit(1);
     }
+    strcpy(addr.sun_path, path);
 
-    struct sockaddr_in client;
-    memset(&client,0,sizeof(client));
-    socklen_t len = sizeof(client);
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        printf("Socket() call failed\n");
+        exit(1);
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        printf("Bind() call failed for %s\n", path);
+        exit(1);
+    }
+    return fd;
+}
 
-    char msgIn[MSGLEN];
-    char msgOut[MSGLEN];
-    bzero(msgIn, MSGLEN);
-    bzero(msgOut, MSGLEN);
+/* worker()
+Worker thread. Serves batches of requests from its UDP socket and, for the worker that has it, the Unix-domain
+socket.
+*/
+
+void *worker(void *arg) {
+    struct worker *w = arg;
+    struct pollfd fds[2] = {{ .fd = w->sockfd, .events = POLLIN }, { .fd = w->unixfd, .events = POLLIN }};
+
+    if (w->cpu != -1) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(w->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
 
-    // Loop listening for data
     while (1) {
+        if (w->unixfd == -1) {
+            // Block for the first request, then take whatever else is already queued
+            serveBatch(w, w->sockfd, MSG_WAITFORONE);
+            continue;
+        }
+        if (poll(fds, 2, -1) <= 0) {
+            continue;
+        }
+        for (int f = 0; f < 2; f++) {
+            if (fds[f].revents & POLLIN) {
+                serveBatch(w, fds[f].fd, MSG_DONTWAIT);
+            }
+        }
+    }
+    return NULL;
+}
 
-        printf("Listening...\n");
+/* Main program for translator
+Implements the functionality of the English-French translator. Creates a UDP socket and listens for data, then reads it in
+the format "word". Translates the word, then sends back the French equivalent to the client.
+Up to BATCH waiting requests are read with one recvmmsg() and answered with one sendmmsg(). A request may be
+tagged (see splitTag()). Run with -v to print each request, and with -p to listen on a port other than PORTNUM
+(to run several replicas on one host). With -u <path> it also answers on a Unix-domain datagram socket, which
+an interserver on the same host can use instead of UDP.
 
-        recvfrom(sockfd, msgIn, MSGLEN, MSG_WAITALL, (struct sockaddr*)&client, &len);
+The words are read from dictionary.txt (micro-1 -d <file>) and reread on SIGHUP. With -w <workers> the translator
+runs several worker threads, each with its own socket on the port (SO_REUSEPORT) and its own copy of the
+dictionary, so they share nothing while serving; -a pins worker i to CPU i. Compile with -pthread.
+*/
 
-        printf("Translating %s...\n", msgIn);
+int main(int argc, char *argv[]) {
 
-        // Translate the input word
-        if (strcasecmp(msgIn, "Hello") == 0) {
-            strcpy(msgOut, "Bonjour");
-        } else if (strcasecmp(msgIn, "Goodbye") == 0) {
-            strcpy(msgOut, "Au revoir");
-        } else if (strcasecmp(msgIn, "Computer") == 0) {
-            strcpy(msgOut, "Ordinateur");
-        } else if (strcasecmp(msgIn, "Ostrich") == 0) {
-            strcpy(msgOut, "Autruche");
-        } else if (strcasecmp(msgIn, "Wine") == 0) {
-            strcpy(msgOut, "Vin");
+    int opt;
+    int port = PORTNUM;
+    int pin = 0;
+    char *unixPath = NULL;
+    while ((opt = getopt(argc, argv, "p:u:w:d:av")) != -1) {
+        if (opt == 'p') {
+            port = atoi(optarg);
+        } else if (opt == 'u') {
+            unixPath = optarg;
+        } else if (opt == 'w') {
+            NumWorkers = atoi(optarg);
+        } else if (opt == 'd') {
+            DictFile = optarg;
+        } else if (opt == 'a') {
+            pin = 1;
+        } else if (opt == 'v') {
+            Verbose = 1;
         } else {
-            strcpy(msgOut, "Undefined");
+            printf("Usage: %s [-p port] [-u socket path] [-w workers] [-d dictionary] [-a] [-v]\n", argv[0]);
+            exit(1);
         }
+    }
+    if (NumWorkers < 1) {
+        NumWorkers = 1;
+    } else if (NumWorkers > MAXWORKERS) {
+        NumWorkers = MAXWORKERS;
+    }
+
+    struct dictionary *dict = loadDictionary(DictFile);
+    if (dict == NULL) {
+        exit(1);
+    }
+
+    // SIGHUP is only taken by the reloader thread
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+
+    struct sockaddr_in sock;
+    memset(&sock,0,sizeof(sock));
+    sock.sin_family = AF_INET;
+    sock.sin_port = htons(port);
+    sock.sin_addr.s_addr = INADDR_ANY;
+    int on = 1;
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // Create one UDP socket per worker; the kernel spreads the clients over them
+    for (int i = 0; i < NumWorkers; i++) {
+        struct worker *w = &Workers[i];
+        w->sockfd = socket(AF_INET,SOCK_DGRAM,IPPROTO_UDP);
+        if (w->sockfd == -1) {
+            printf("Socket() call failed\n");
+            exit(1);
+        }
+        if (NumWorkers > 1 && setsockopt(w->sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+            printf("Setsockopt failed\n");
+            exit(1);
+        }
+        if(bind(w->sockfd,(struct sockaddr*)&sock,sizeof(sock)) == -1) {
+            printf("Bind() call failed\n");
+            exit(1);
+        }
+        w->unixfd = -1;
+        w->cpu = pin ? i % cpus : -1;
+        w->dict = malloc(sizeof(struct dictionary));
+        memcpy(w->dict, dict, sizeof(struct dictionary));
+        w->msgIn = malloc(BATCH * MSGLEN);
+        w->msgOut = malloc(BATCH * MSGLEN);
+    }
+    free(dict);
+
+    if (unixPath != NULL) {
+        Workers[0].unixfd = bindUnix(unixPath);
+    }
+
+    pthread_t reload;
+    if (pthread_create(&reload, NULL, reloader, &hup) != 0) {
+        printf("Could not start reloader\n");
+        exit(1);
+    }
+    for (int i = 0; i < NumWorkers; i++) {
+        if (pthread_create(&Workers[i].thread, NULL, worker, &Workers[i]) != 0) {
+            printf("Could not start worker %d\n", i);
+            exit(1);
+        }
+    }
 
-        // Send response back
-        sendto(sockfd, msgOut, sizeof(msgOut), 0, (const struct sockaddr *) &client, sizeof(client));
+    printf("Listening with %d workers...\n", NumWorkers);
 
-        printf("Translation sent back\n");
+    for (int i = 0; i < NumWorkers; i++) {
+        pthread_join(Workers[i].thread, NULL);
     }
-    
-    close(sockfd);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -5,117 +6,458 @@
 #include <signal.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <arpa/inet.h> 
+#include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <math.h>
 #include <sys/time.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 
 #define PORTNUM 9571
 #define MSGLEN 3000
+#define MAXWORKERS 64
+#define BATCH 64            // most datagrams read or answered by one system call
+#define TAGLEN 24           // longest request tag echoed back to the client
 
-/* Main program for currency converter
-Implements the functionality of the converter. Creates a UDP socket and listens for data, then reads it in 
-the format "amount source dest". If the source and dest currencies are the same, it simply returns the original
-value. If they are different, it converts the source amount to CAD and then to the destination currency. Sends
-back the return value as a float to the same client.
+// Exchange rates
+#define RATESFILE "rates.txt"
+#define MAXCURRENCIES 64
+
+// Print a line for every request only when started with -v
+#define LOG(...) do { if (Verbose) printf(__VA_ARGS__); } while (0)
+
+// Exchange rates to and from CAD
+struct rate_table {
+    long version;           // hash of the table, the same on every replica with these rates
+    int numCurrencies;
+    char code[MAXCURRENCIES][4];
+    double toCad[MAXCURRENCIES];
+    double fromCad[MAXCURRENCIES];
+};
+
+// A worker thread with its own socket and its own copy of the rates
+struct worker {
+    pthread_t thread;
+    int sockfd;
+    int unixfd;                     // Unix-domain socket served by this worker, or -1
+    int cpu;                        // CPU the worker is pinned to, or -1
+    struct rate_table *rates;       // only read and freed by the worker
+    struct rate_table *pending;     // a reloaded copy, swapped in before the next batch
+    char (*msgIn)[MSGLEN];
+    char (*msgOut)[MSGLEN];
+};
+
+struct worker Workers[MAXWORKERS];
+int NumWorkers = 1;
+char *RatesFile = RATESFILE;
+int Verbose = 0;
+
+/* splitTag()
+Requests may start with a tag of the form "@<id> " which is echoed at the start of the reply, so the client
+can match replies to retransmitted requests. Copies the tag into reply and returns its length (0 if untagged).
 */
-int main() {
 
-    // Create UDP socket
-    int sockfd = socket(AF_INET,SOCK_DGRAM,IPPROTO_UDP);
-    if (sockfd == -1) {
-        printf("Socket() call failed\n");
-        exit(1);
+int splitTag(char *msg, char *reply) {
+    if (msg[0] != '@') {
+        return 0;
+    }
+    int len = strcspn(msg, " ");
+    if (msg[len] != ' ' || len > TAGLEN) {
+        return 0;
     }
+    memcpy(reply, msg, len + 1);
+    return len + 1;
+}
 
-    struct sockaddr_in sock;
-    memset(&sock,0,sizeof(sock));
-    sock.sin_family = AF_INET;
-    sock.sin_port = htons(PORTNUM);
-    sock.sin_addr.s_addr = INADDR_ANY;
+/* hashRates()
+Returns the version of a rate table: an FNV-1a hash of its currency codes and factors, kept positive and never 0
+(the interserver's "unknown").
+*/
 
-    if(bind(sockfd,(struct sockaddr*)&sock,sizeof(sock)) == -1) {
-        printf("Bind() call failed\n");
-        exit(1);
+long hashRates(struct rate_table *rates) {
+    unsigned long hash = 14695981039346656037UL;
+    for (int i = 0; i < rates->numCurrencies; i++) {
+        unsigned char bytes[4 + 2 * sizeof(double)] = {0};
+        memcpy(bytes, rates->code[i], strlen(rates->code[i]));
+        memcpy(bytes + 4, &rates->toCad[i], sizeof(double));
+        memcpy(bytes + 4 + sizeof(double), &rates->fromCad[i], sizeof(double));
+        for (size_t b = 0; b < sizeof(bytes); b++) {
+            hash = (hash ^ bytes[b]) * 1099511628211UL;
+        }
+    }
+    hash &= 0x7fffffffffffffffUL;
+    return hash != 0 ? (long)hash : 1;
+}
+
+/* loadRates()
+Reads the exchange rates from a file with one "<currency> <to CAD> <from CAD>" line per currency, giving the
+factors that convert an amount of it into CAD and CAD into it. Lines starting with # are comments. Returns a new
+table, or NULL if the file cannot be read or has no currencies.
+*/
+
+struct rate_table *loadRates(char *path) {
+    char line[128];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        printf("Could not open rates file %s\n", path);
+        return NULL;
+    }
+
+    struct rate_table *rates = calloc(1, sizeof(struct rate_table));
+    while (fgets(line, sizeof(line), f) != NULL && rates->numCurrencies < MAXCURRENCIES) {
+        int n = rates->numCurrencies;
+        if (line[0] == '#' || sscanf(line, "%3s %lf %lf", rates->code[n], &rates->toCad[n], &rates->fromCad[n]) != 3) {
+            continue;
+        }
+        rates->numCurrencies++;
     }
+    fclose(f);
 
-    struct sockaddr_in client;
-    memset(&client,0,sizeof(client));
-    socklen_t len = sizeof(client);
+    if (rates->numCurrencies == 0) {
+        printf("No currencies in %s\n", path);
+        free(rates);
+        return NULL;
+    }
+    rates->version = hashRates(rates);
+    return rates;
+}
 
-    char msgIn[MSGLEN] = {0};
-    char msgOut[MSGLEN];
+/* reloader()
+Thread that rereads the rates file on SIGHUP. Every worker gets a copy of its own, handed over by swapping its
+pending pointer; a copy the worker has not picked up yet is freed here, and the worker frees the one it replaces,
+so no worker ever reads memory another thread may free.
+*/
+
+void *reloader(void *arg) {
+    sigset_t *hup = arg;
+    int sig;
+
+    while (sigwait(hup, &sig) == 0) {
+        struct rate_table *rates = loadRates(RatesFile);
+        if (rates == NULL) {
+            printf("Keeping the old rates\n");
+            continue;
+        }
+        for (int i = 0; i < NumWorkers; i++) {
+            struct rate_table *copy = malloc(sizeof(struct rate_table));
+            memcpy(copy, rates, sizeof(struct rate_table));
+            free(__atomic_exchange_n(&Workers[i].pending, copy, __ATOMIC_ACQ_REL));
+        }
+        printf("Reloaded %d currencies from %s (version %ld)\n", rates->numCurrencies, RatesFile, rates->version);
+        free(rates);
+    }
+    return NULL;
+}
+
+/* findCurrency()
+Returns the index of a currency in the rate table, or -1 if it is not there.
+*/
+
+int findCurrency(struct rate_table *rates, char *code) {
+    for (int i = 0; i < rates->numCurrencies; i++) {
+        if (strcasecmp(code, rates->code[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* convert()
+Parses a request of the form "amount source dest" and writes the converted amount into reply. If the source
+and dest currencies are the same, it simply returns the original value. If they are different, it converts
+the source amount to CAD and then to the destination currency. The request "rates" is answered with the
+version of the rate table, so clients caching conversions can tell when the rates have changed. Returns the
+length of the reply.
+*/
+
+int convert(struct rate_table *rates, char *request, char *reply) {
     char *v;
     float value = 0;
     char *source;
     char *dest;
     char *c;
-    float result;
+    char *save;
+    float result = 0;
     float valueCopy;
 
-    // Loop for data
-    while (1) {
+    if (strcasecmp(request, "rates") == 0) {
+        return sprintf(reply, "%ld", rates->version);
+    }
+
+    // Parse string into amount, source, dest
+    c = strtok_r(request, " ", &save);
+    v = c;
+    c = strtok_r(NULL, " ", &save);
+    source = c;
+    c = strtok_r(NULL, " ", &save);
+    dest = c;
+    if (v == NULL || source == NULL || dest == NULL) {
+        strcpy(reply, "Undefined");
+        return strlen(reply);
+    }
+    value = atof(v);
+    dest[strcspn(dest, "\r\n")] = '\0';
+    if (strlen(dest) > 3) {
+        dest[3] = '\0';
+    }
+
+    valueCopy = value;
+
+    // Convert to CAD (an unknown source currency is taken as CAD)
+    int from = findCurrency(rates, source);
+    if (from != -1) {
+        value = rates->toCad[from] * value;
+    }
+
+    // Convert to dest currency (an unknown one gives 0)
+    int to = findCurrency(rates, dest);
+    if (to != -1) {
+        result = rates->fromCad[to];
+    }
+
+    // Calculate result
+    result = result * value;
+
+    if (strcasecmp(source, dest) == 0) {
+        result = valueCopy;
+    }
+
+    return sprintf(reply, "%.2f", result);
+}
+
+/* serveBatch()
+Reads up to BATCH waiting requests from sockfd with one recvmmsg(), converts them and sends the results back
+with one sendmmsg(). With MSG_WAITFORONE it blocks for the first request.
+*/
+
+int serveBatch(struct worker *w, int sockfd, int flags) {
 
-        printf("Listening...\n");
-
-        recvfrom(sockfd, msgIn, MSGLEN, MSG_WAITALL, (struct sockaddr*)&client, &len);
-        printf("Converting %s...\n", msgIn);
-        
-        // Parse string into amount, source, dest
-        c = strtok(msgIn, " ");
-        v = c;
-        value = atof(v);
-        c = strtok(NULL, " ");
-        source = c;
-        c = strtok(NULL, " ");
-        dest = c;
-        strcpy((dest + 3), "\0");
-        strcpy((dest + 4), "\0");
-
-        valueCopy = value;
-
-        // Convert to CAD
-        if (strcasecmp(source, "USD") == 0) {
-            value = 1.23 * value;
-        } else if (strcasecmp(source, "EUR") == 0) {
-            value = 1.44 * value;
-        } else if (strcasecmp(source, "GBP") == 0) {
-            value = 1.70 * value;
-        } else if (strcasecmp(source, "BTC") == 0) {
-            value = 82198.67 * value;
+    // One buffer, client address and message header per request in a batch
+    char (*msgIn)[MSGLEN] = w->msgIn;
+    char (*msgOut)[MSGLEN] = w->msgOut;
+    struct sockaddr_storage clients[BATCH];
+    struct iovec inVecs[BATCH], outVecs[BATCH];
+    struct mmsghdr inMsgs[BATCH], outMsgs[BATCH];
+
+    memset(inMsgs, 0, sizeof(inMsgs));
+    memset(outMsgs, 0, sizeof(outMsgs));
+    for (int i = 0; i < BATCH; i++) {
+        inVecs[i].iov_base = msgIn[i];
+        inVecs[i].iov_len = MSGLEN - 1;
+        inMsgs[i].msg_hdr.msg_iov = &inVecs[i];
+        inMsgs[i].msg_hdr.msg_iovlen = 1;
+        inMsgs[i].msg_hdr.msg_name = &clients[i];
+        inMsgs[i].msg_hdr.msg_namelen = sizeof(clients[i]);
+        outVecs[i].iov_base = msgOut[i];
+        outMsgs[i].msg_hdr.msg_iov = &outVecs[i];
+        outMsgs[i].msg_hdr.msg_iovlen = 1;
+        outMsgs[i].msg_hdr.msg_name = &clients[i];
+    }
+
+    int n = recvmmsg(sockfd, inMsgs, BATCH, flags, NULL);
+    if (n <= 0) {
+        return 0;
+    }
+
+    // Take up reloaded rates between batches
+    struct rate_table *fresh = __atomic_exchange_n(&w->pending, NULL, __ATOMIC_ACQ_REL);
+    if (fresh != NULL) {
+        free(w->rates);
+        w->rates = fresh;
+    }
+
+    for (int i = 0; i < n; i++) {
+        msgIn[i][inMsgs[i].msg_len] = '\0';
+        int tagLen = splitTag(msgIn[i], msgOut[i]);
+        LOG("Converting %s...\n", msgIn[i] + tagLen);
+        outVecs[i].iov_len = tagLen + convert(w->rates, msgIn[i] + tagLen, msgOut[i] + tagLen);
+        outMsgs[i].msg_hdr.msg_namelen = inMsgs[i].msg_hdr.msg_namelen;
+        LOG("The result is %s...sending back\n", msgOut[i]);
+    }
+
+    // Send back to clients
+    for (int sent = 0; sent < n; ) {
+        int m = sendmmsg(sockfd, outMsgs + sent, n - sent, 0);
+        if (m <= 0) {
+            break;
         }
+        sent += m;
+    }
+    return n;
+}
 
-        // Convert to dest currency
-        if(strcasecmp(dest, "CAD") == 0) {
-            result = 1.0;
-        } else if(strcasecmp(dest, "USD") == 0) {
-            result = 0.81;
-        } else if(strcasecmp(dest, "EUR") == 0) {
-            result = 0.70;
-        } else if(strcasecmp(dest, "GBP") == 0) {
-            result = 0.59;
-        } else if(strcasecmp(dest, "BTC") == 0) {
-            result = 0.000013;
+/* bindUnix()
+Creates a Unix-domain datagram socket at the given path, for an interserver on the same host, and returns it.
+*/
+
+int bindUnix(char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s is too long\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        printf("Socket() call failed\n");
+        exit(1);
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        printf("Bind() call failed for %s\n", path);
+        exit(1);
+    }
+    return fd;
+}
+
+/* worker()
+Worker thread. Serves batches of requests from its UDP socket and, for the worker that has it, the Unix-domain
+socket.
+*/
+
+void *worker(void *arg) {
+    struct worker *w = arg;
+    struct pollfd fds[2] = {{ .fd = w->sockfd, .events = POLLIN }, { .fd = w->unixfd, .events = POLLIN }};
+
+    if (w->cpu != -1) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(w->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    while (1) {
+        if (w->unixfd == -1) {
+            // Block for the first request, then take whatever else is already queued
+            serveBatch(w, w->sockfd, MSG_WAITFORONE);
+            continue;
         }
+        if (poll(fds, 2, -1) <= 0) {
+            continue;
+        }
+        for (int f = 0; f < 2; f++) {
+            if (fds[f].revents & POLLIN) {
+                serveBatch(w, fds[f].fd, MSG_DONTWAIT);
+            }
+        }
+    }
+    return NULL;
+}
 
-        // Calculate result
-        result = result * value;
+/* Main program for currency converter
+Implements the functionality of the converter. Creates a UDP socket and listens for data, then reads it in
+the format "amount source dest", converts it, and sends back the return value as a float to the same client.
+Up to BATCH waiting requests are read with one recvmmsg() and answered with one sendmmsg(). A request may be
+tagged (see splitTag()). Run with -v to print each request, and with -p to listen on a port other than PORTNUM
+(to run several replicas on one host). With -u <path> it also answers on a Unix-domain datagram socket, which
+an interserver on the same host can use instead of UDP.
 
-        if (strcasecmp(source, dest) == 0) {
-            result = valueCopy;
+The exchange rates are read from rates.txt (micro-2 -r <file>) and reread on SIGHUP. With -w <workers> the
+converter runs several worker threads, each with its own socket on the port (SO_REUSEPORT) and its own copy of
+the rates, so they share nothing while serving; -a pins worker i to CPU i. Compile with -pthread.
+*/
+int main(int argc, char *argv[]) {
+
+    int opt;
+    int port = PORTNUM;
+    int pin = 0;
+    char *unixPath = NULL;
+    while ((opt = getopt(argc, argv, "p:u:w:r:av")) != -1) {
+        if (opt == 'p') {
+            port = atoi(optarg);
+        } else if (opt == 'u') {
+            unixPath = optarg;
+        } else if (opt == 'w') {
+            NumWorkers = atoi(optarg);
+        } else if (opt == 'r') {
+            RatesFile = optarg;
+        } else if (opt == 'a') {
+            pin = 1;
+        } else if (opt == 'v') {
+            Verbose = 1;
+        } else {
+            printf("Usage: %s [-p port] [-u socket path] [-w workers] [-r rates] [-a] [-v]\n", argv[0]);
+            exit(1);
         }
+    }
+    if (NumWorkers < 1) {
+        NumWorkers = 1;
+    } else if (NumWorkers > MAXWORKERS) {
+        NumWorkers = MAXWORKERS;
+    }
 
-        // Send back to client
-        sprintf(msgOut, "%.2f", result);
-        printf("The result is %s...sending back\n", msgOut);
+    struct rate_table *rates = loadRates(RatesFile);
+    if (rates == NULL) {
+        exit(1);
+    }
 
-        sendto(sockfd, msgOut, sizeof(msgOut), 0, (const struct sockaddr *) &client, sizeof(client));
+    // SIGHUP is only taken by the reloader thread
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
 
+    struct sockaddr_in sock;
+    memset(&sock,0,sizeof(sock));
+    sock.sin_family = AF_INET;
+    sock.sin_port = htons(port);
+    sock.sin_addr.s_addr = INADDR_ANY;
+    int on = 1;
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // Create one UDP socket per worker; the kernel spreads the clients over them
+    for (int i = 0; i < NumWorkers; i++) {
+        struct worker *w = &Workers[i];
+        w->sockfd = socket(AF_INET,SOCK_DGRAM,IPPROTO_UDP);
+        if (w->sockfd == -1) {
+            printf("Socket() call failed\n");
+            exit(1);
+        }
+        if (NumWorkers > 1 && setsockopt(w->sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+            printf("Setsockopt failed\n");
+            exit(1);
+        }
+        if(bind(w->sockfd,(struct sockaddr*)&sock,sizeof(sock)) == -1) {
+            printf("Bind() call failed\n");
+            exit(1);
+        }
+        w->unixfd = -1;
+        w->cpu = pin ? i % cpus : -1;
+        w->rates = malloc(sizeof(struct rate_table));
+        memcpy(w->rates, rates, sizeof(struct rate_table));
+        w->msgIn = malloc(BATCH * MSGLEN);
+        w->msgOut = malloc(BATCH * MSGLEN);
     }
+    free(rates);
 
-    close(sockfd);
+    if (unixPath != NULL) {
+        Workers[0].unixfd = bindUnix(unixPath);
+    }
+
+    pthread_t reload;
+    if (pthread_create(&reload, NULL, reloader, &hup) != 0) {
+        printf("Could not start reloader\n");
+        exit(1);
+    }
+    for (int i = 0; i < NumWorkers; i++) {
+        if (pthread_create(&Workers[i].thread, NULL, worker, &Workers[i]) != 0) {
+            printf("Could not start worker %d\n", i);
+            exit(1);
+        }
+    }
+
+    printf("Listening with %d workers...\n", NumWorkers);
+
+    for (int i = 0; i < NumWorkers; i++) {
+        pthread_join(Workers[i].thread, NULL);
+    }
     return 0;
-}
\ No newline at end of file
+}
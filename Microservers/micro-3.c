@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -5,152 +6,1203 @@
 #include <signal.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <arpa/inet.h> 
+#include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sched.h>
 #include <sys/time.h>
+#include <time.h>
 
 #define PORTNUM 8552
 #define MSGLEN 3000
+#define MAXWORKERS 64
+#define BATCH 64            // most datagrams read or answered by one system call
+#define TAGLEN 24           // longest request tag echoed back to the client
+
+// Durable vote storage
+#define VOTELOG "votes.log"
+#define SNAPFILE "votes.snap"
+#define RECLEN 96           // maximum length of a single log record
+#define TOKENLEN 24         // maximum length of a ballot's idempotency token, including the NUL
+#define COMMITBATCH 128     // initial capacity of a group commit batch
+#define SNAPEVERY 10000     // log records between snapshots
+
+// Vote handshakes
+#define SESSIONMS 120000    // how long a voter has to send their vote after receiving a key
+
+// Voter registry
+#define NUMSTRIPES 64       // independently locked parts of the registry, a power of two
+
+// Candidates
+#define CANDIDATEFILE "candidates.txt"
+#define MAXCANDIDATES 16
+#define NAMELEN 64
+#define SUMMARYMS 100       // how long a summary may be reused while votes keep arriving
 
 /* Main program for voting service
-Implements the functionality of the voting service. Creates a UDP socket and listens for data, then reads it in 
+Implements the functionality of the voting service. Creates a UDP socket and listens for data, then reads it in
 the format "command IP". If the command is "vote", it checks that the IP address has not been used to
-vote before, and sends an encryption key before receiving/counting the vote and updating the voter list. If it 
+vote before, and sends an encryption key before receiving/counting the vote and updating the voter list. If it
 is "summary", it checks that the IP address has already voted. If it is "show", it sends back a list of the candidates.
+The candidates and the votes they had before this service started are read from candidates.txt (micro-3 -c <file>).
+The replies to "show" and "summary" are kept rendered; "summary" is only re-rendered once votes have arrived (and
+then at most every SUMMARYMS, unless the asking voter's own vote is not in it yet).
+
+A "ballot IP candidate token" request casts a vote in one round trip. The token is chosen by the interserver
+and stored with the vote, so a retried ballot is acknowledged again but never counted twice.
+
+For the "vote" handshake, the encrypted vote arrives as a separate datagram. Each handshake is kept in a session table keyed by the
+interserver's address until the vote arrives or SESSIONMS passes, so the loop never waits on one voter.
+
+Requests are served by several worker threads (micro-3 -w <workers>), each with its own socket on the port
+(SO_REUSEPORT) and its own tally counters, which are added up for "summary"; -a pins worker i to CPU i. Each
+worker reads up to BATCH waiting requests with one recvmmsg() and sends the replies with one sendmmsg(); run with
+-v to print each request. A request may be tagged (see splitTag()). The kernel sends all datagrams
+from one interserver address to the same worker, so a worker's handshake table needs no locking. The voter
+registry is split into NUMSTRIPES locked parts, so checking and recording a voter is atomic.
+
+Accepted votes are appended to a write-ahead log (votes.log) by a log writer thread and acknowledged only once
+they are on disk. All votes that arrive while one fsync is running share the next one (group commit), and every
+SNAPEVERY records the tallies and voter list are written to a snapshot (votes.snap) and the log is truncated. On
+startup the snapshot is loaded and the log tail replayed. The log and snapshot live in the working directory, so
+the voting service keeps a single instance; -p changes the port it listens on. With -u <path> it also listens on a
+Unix-domain datagram socket for an interserver on the same host, served by the first worker.
+
+Compile with -pthread.
 */
 
-int main() {
+// Voter registry entry states
+#define EMPTY 0
+#define RESERVED 1          // holds an encryption key, vote not yet received
+#define VOTED 2
 
-    // Create socket for UDP data
-    int sockfd = socket(AF_INET,SOCK_DGRAM,IPPROTO_UDP);
-    if (sockfd == -1) {
-        printf("Socket() call failed\n");
+// IP addresses that have asked to vote, kept in open-addressing hash tables
+struct voter {
+    char ip[20];
+    int state;
+    long expires;           // when a RESERVED entry lapses, in ms
+    char token[TOKENLEN];   // token of the ballot that was counted, "-" for a handshake vote
+    long seq;               // log record holding the vote
+};
+
+struct voter_table {
+    pthread_mutex_t lock;
+    int numUsed;
+    int capacity;           // always a power of two
+    struct voter *slots;
+} __attribute__((aligned(64)));
+
+struct voter_table Voters[NUMSTRIPES];
+
+// Where a request came from: the socket it arrived on and the sender's UDP or Unix-domain address
+struct peer {
+    int sockfd;
+    socklen_t len;
+    struct sockaddr_storage addr;
+};
+
+// A vote handshake waiting for the encrypted vote, keyed by the interserver's address
+struct session {
+    struct peer addr;
+    int used;
+    int key;
+    long expires;
+    char ip[20];            // voter this session belongs to
+};
+
+struct session_table {
+    int numUsed;
+    int capacity;           // always a power of two
+    struct session *slots;
+};
+
+// Votes counted by one worker, on a cache line of their own
+struct tally_shard {
+    long votes[MAXCANDIDATES];
+} __attribute__((aligned(64)));
+
+struct worker {
+    pthread_t thread;
+    int sockfd;
+    int unixfd;                 // Unix-domain socket served by this worker, or -1
+    int cpu;                    // CPU the worker is pinned to, or -1
+    unsigned int seed;
+    struct session_table sessions;
+};
+
+struct worker Workers[MAXWORKERS];
+struct tally_shard Tallies[MAXWORKERS];
+int NumWorkers;
+
+// Candidates in ballot order (ID 1 first), with the votes recovered at startup
+struct candidate {
+    char name[NAMELEN];
+    long votes;
+};
+
+struct candidate Candidates[MAXCANDIDATES];
+int NumCandidates;
+
+// Replies to "show" and "summary", rendered ahead of time
+char ShowText[MSGLEN];
+int ShowLen;
+
+struct summary_cache {
+    pthread_rwlock_t lock;      // guards the rendered text
+    pthread_mutex_t rebuild;    // one worker re-renders at a time
+    char text[MSGLEN];
+    int len;
+    long seq;                   // every vote up to this log record is included
+    long builtAt;
+} Summary;
+
+// A client waiting for "vote counted"
+struct vote_ack {
+    struct peer addr;
+    char tag[TAGLEN + 2];   // request tag to echo, if any
+};
+
+// Log records and acknowledgements collected for one fsync
+struct log_batch {
+    char *buf;
+    int bufLen;
+    int bufCap;
+    struct vote_ack *acks;
+    int numAcks;
+    int ackCap;
+    long counts[MAXCANDIDATES];
+    long lastSeq;
+};
+
+// State of the write-ahead log; the batch being filled is guarded by lock
+struct vote_log {
+    int fd;
+    long seq;                   // sequence number of the last record appended
+    long snapSeq;               // last sequence number covered by the snapshot
+    long committedSeq;          // last sequence number known to be on disk
+    long tally[MAXCANDIDATES];  // tallies including every committed record
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct log_batch batches[2];
+    int filling;                // batch workers are adding to; the log writer owns the other
+} VoteLog;
+
+// Print a line for every request only when started with -v
+#define LOG(...) do { if (Verbose) printf(__VA_ARGS__); } while (0)
+
+int Verbose = 0;
+
+int removeSession(struct session_table *t, struct session *s);
+
+/* nowMs()
+Returns a monotonic timestamp in milliseconds.
+*/
+
+long nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* hashString()
+FNV-1a hash of a NUL-terminated string.
+*/
+
+unsigned int hashString(char *str) {
+    unsigned int h = 2166136261u;
+    while (*str) {
+        h = (h ^ (unsigned char) *str++) * 16777619u;
+    }
+    return h;
+}
+
+/* hashAddr()
+Hash of a client's IP address and port, or of its Unix-domain socket name.
+*/
+
+unsigned int hashAddr(struct peer *addr) {
+    if (addr->addr.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *) &addr->addr;
+        unsigned int h = in->sin_addr.s_addr * 2654435761u;
+        return (h ^ in->sin_port) * 2246822519u;
+    }
+    unsigned int h = 2166136261u;
+    for (socklen_t i = 0; i < addr->len; i++) {
+        h = (h ^ ((unsigned char *) &addr->addr)[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* sameAddr()
+Returns 1 if two clients have the same address.
+*/
+
+int sameAddr(struct peer *a, struct peer *b) {
+    if (a->addr.ss_family == AF_INET && b->addr.ss_family == AF_INET) {
+        struct sockaddr_in *x = (struct sockaddr_in *) &a->addr;
+        struct sockaddr_in *y = (struct sockaddr_in *) &b->addr;
+        return x->sin_addr.s_addr == y->sin_addr.s_addr && x->sin_port == y->sin_port;
+    }
+    return a->len == b->len && memcmp(&a->addr, &b->addr, a->len) == 0;
+}
+
+/* lockVoter()
+Locks and returns the part of the voter registry that holds the given IP address.
+*/
+
+struct voter_table *lockVoter(char *ip) {
+    struct voter_table *t = &Voters[hashString(ip) & (NUMSTRIPES - 1)];
+    pthread_mutex_lock(&t->lock);
+    return t;
+}
+
+/* findVoter()
+Returns the registry entry for the given IP address, or NULL if it has never asked to vote. The caller
+holds the lock from lockVoter().
+*/
+
+struct voter *findVoter(struct voter_table *t, char *ip) {
+    if (t->capacity == 0) {
+        return NULL;
+    }
+    unsigned int i = (hashString(ip) / NUMSTRIPES) & (t->capacity - 1);
+    while (t->slots[i].state != EMPTY) {
+        if (strcmp(t->slots[i].ip, ip) == 0) {
+            return &t->slots[i];
+        }
+        i = (i + 1) & (t->capacity - 1);
+    }
+    return NULL;
+}
+
+/* addVoter()
+Inserts an IP address into the voter registry with the given state, doubling the table when it is 70% full.
+Returns the new entry. The caller holds the lock from lockVoter().
+*/
+
+struct voter *addVoter(struct voter_table *t, char *ip, int state) {
+    if ((t->numUsed + 1) * 10 > t->capacity * 7) {
+        struct voter *old = t->slots;
+        int oldCap = t->capacity;
+        t->capacity = oldCap ? oldCap * 2 : 64;
+        t->slots = calloc(t->capacity, sizeof(struct voter));
+        if (t->slots == NULL) {
+            printf("Out of memory for voter registry\n");
+            exit(1);
+        }
+        t->numUsed = 0;
+        for (int j = 0; j < oldCap; j++) {
+            if (old[j].state != EMPTY) {
+                *addVoter(t, old[j].ip, old[j].state) = old[j];
+            }
+        }
+        free(old);
+    }
+
+    unsigned int i = (hashString(ip) / NUMSTRIPES) & (t->capacity - 1);
+    while (t->slots[i].state != EMPTY) {
+        i = (i + 1) & (t->capacity - 1);
+    }
+    strncpy(t->slots[i].ip, ip, 19);
+    t->slots[i].state = state;
+    t->numUsed++;
+    return &t->slots[i];
+}
+
+/* findSession()
+Returns the live handshake for a client address, or NULL. A lapsed handshake is removed when found.
+*/
+
+struct session *findSession(struct session_table *t, struct peer *addr) {
+    if (t->capacity == 0) {
+        return NULL;
+    }
+    unsigned int i = hashAddr(addr) & (t->capacity - 1);
+    while (t->slots[i].used) {
+        struct session *s = &t->slots[i];
+        if (sameAddr(&s->addr, addr)) {
+            if (s->expires < nowMs()) {
+                removeSession(t, s);
+                return NULL;
+            }
+            return s;
+        }
+        i = (i + 1) & (t->capacity - 1);
+    }
+    return NULL;
+}
+
+/* removeSession()
+Deletes a handshake, shifting later entries of its probe run back so no tombstones are needed.
+*/
+
+int removeSession(struct session_table *t, struct session *s) {
+    unsigned int mask = t->capacity - 1;
+    unsigned int hole = s - t->slots;
+    unsigned int i = (hole + 1) & mask;
+
+    while (t->slots[i].used) {
+        unsigned int home = hashAddr(&t->slots[i].addr) & mask;
+        // Move the entry into the hole if its home slot is not between the hole and its position
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+        i = (i + 1) & mask;
+    }
+    t->slots[hole].used = 0;
+    t->numUsed--;
+    return 0;
+}
+
+/* addSession()
+Starts a handshake for a client address, replacing any earlier one from the same address. The table is
+swept of lapsed handshakes, and doubled if still needed, when it is 70% full.
+*/
+
+struct session *addSession(struct session_table *t, struct peer *addr, char *ip, int key) {
+    struct session *s = findSession(t, addr);
+    if (s != NULL) {
+        removeSession(t, s);
+    }
+
+    if ((t->numUsed + 1) * 10 > t->capacity * 7) {
+        long now = nowMs();
+        for (int j = 0; j < t->capacity; j++) {
+            // A removal can shift a later entry into j, so look at j again
+            while (t->slots[j].used && t->slots[j].expires < now) {
+                removeSession(t, &t->slots[j]);
+            }
+        }
+    }
+    if ((t->numUsed + 1) * 10 > t->capacity * 7) {
+        struct session *old = t->slots;
+        int oldCap = t->capacity;
+        t->capacity = oldCap ? oldCap * 2 : 1024;
+        t->slots = calloc(t->capacity, sizeof(struct session));
+        if (t->slots == NULL) {
+            printf("Out of memory for vote sessions\n");
+            exit(1);
+        }
+        t->numUsed = 0;
+        for (int j = 0; j < oldCap; j++) {
+            if (old[j].used) {
+                *addSession(t, &old[j].addr, old[j].ip, old[j].key) = old[j];
+            }
+        }
+        free(old);
+    }
+
+    unsigned int i = hashAddr(addr) & (t->capacity - 1);
+    while (t->slots[i].used) {
+        i = (i + 1) & (t->capacity - 1);
+    }
+    s = &t->slots[i];
+    s->addr = *addr;
+    s->used = 1;
+    s->key = key;
+    s->expires = nowMs() + SESSIONMS;
+    bzero(s->ip, 20);
+    strncpy(s->ip, ip, 19);
+    t->numUsed++;
+    return s;
+}
+
+/* recordVoter()
+Marks an IP address as having voted with the given token and log record, during recovery.
+*/
+
+int recordVoter(char *ip, char *token, long seq) {
+    struct voter_table *t = lockVoter(ip);
+    struct voter *voter = findVoter(t, ip);
+    if (voter == NULL) {
+        voter = addVoter(t, ip, VOTED);
+    }
+    voter->state = VOTED;
+    voter->seq = seq;
+    strcpy(voter->token, token);
+    pthread_mutex_unlock(&t->lock);
+    return 0;
+}
+
+/* loadSnapshot()
+Restores the tallies and voter list from the snapshot file, if there is one. The snapshot has the form
+"snapshot <seq> <numCandidates> <numVoters>", followed by one tally per line and one "IP token" per line.
+*/
+
+int loadSnapshot() {
+    FILE *f = fopen(SNAPFILE, "r");
+    if (f == NULL) {
+        return 0;
+    }
+
+    long seq;
+    int numCand, numVoters;
+    char ip[20];
+    char token[TOKENLEN];
+    if (fscanf(f, "snapshot %ld %d %d", &seq, &numCand, &numVoters) != 3) {
+        printf("Snapshot %s is corrupt\n", SNAPFILE);
         exit(1);
     }
+    if (numCand != NumCandidates) {
+        printf("Snapshot %s has %d candidates but %s lists %d\n", SNAPFILE, numCand, CANDIDATEFILE, NumCandidates);
+        exit(1);
+    }
+    for (int i = 0; i < numCand; i++) {
+        if (fscanf(f, "%ld", &Candidates[i].votes) != 1) {
+            printf("Snapshot %s is corrupt\n", SNAPFILE);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < numVoters; i++) {
+        if (fscanf(f, "%19s %23s", ip, token) != 2) {
+            printf("Snapshot %s is corrupt\n", SNAPFILE);
+            exit(1);
+        }
+        recordVoter(ip, token, 0);
+    }
+    fclose(f);
 
-    char list[300] = "\nThe candidates are:\nBen Smith (ID 1)\nJessica Narwhal (ID 2)\nKimberly Johnson (ID 3)\nTristan Roberts (ID 4)\n\n";
-    char msgIn[MSGLEN] = {0};
-    char msgOut[MSGLEN] = {0};
-    char key[5] = "5";
-    char *c;
-    char command[20];
-    char summary[MSGLEN];
-    int clientVote;
-    char voterList[10][20];
-    int numVoted = 0;
-    int voted = 0;
-    char * clientIP;
-    char cIP[20] = {0};
+    VoteLog.seq = seq;
+    VoteLog.snapSeq = seq;
+    VoteLog.committedSeq = seq;
+    printf("Loaded snapshot at record %ld with %d voters\n", seq, numVoters);
+    return 0;
+}
 
-    // for each candidate, track ID and number of votes
-    int candidates[4][2];
+/* replayLog()
+Opens the write-ahead log and applies every complete record newer than the snapshot. Each record has the
+form "<seq> <IP> <candidate> <token>\n". A torn record left by a crash mid-write is cut off the end of the log.
+*/
 
-    for (int i = 1; i < 5; i++) {
-        candidates[i-1][0] = i;
+int replayLog() {
+    VoteLog.fd = open(VOTELOG, O_RDWR | O_CREAT, 0644);
+    if (VoteLog.fd == -1) {
+        printf("Could not open vote log %s\n", VOTELOG);
+        exit(1);
     }
 
-    // Set votes for each candidate
-    candidates[0][1] = 34221;
-    candidates[1][1] = 4566;
-    candidates[2][1] = 34221;
-    candidates[3][1] = 14504;
+    FILE *f = fdopen(dup(VoteLog.fd), "r");
+    char line[RECLEN];
+    char ip[20];
+    char token[TOKENLEN];
+    long seq;
+    int vote;
+    long good = 0;
+    int replayed = 0;
 
-    // initialize and bind socket
-    struct sockaddr_in sock;
-    memset(&sock,0,sizeof(sock));
-    sock.sin_family = AF_INET;
-    sock.sin_port = htons(PORTNUM);
-    sock.sin_addr.s_addr = INADDR_ANY;
+    while (fgets(line, RECLEN, f) != NULL) {
+        if (line[strlen(line) - 1] != '\n' || sscanf(line, "%ld %19s %d %23s", &seq, ip, &vote, token) != 4) {
+            break;
+        }
+        good += strlen(line);
+        if (seq <= VoteLog.snapSeq) {
+            // Already part of the snapshot
+            continue;
+        }
+        if (vote >= 1 && vote <= NumCandidates) {
+            Candidates[vote - 1].votes++;
+        }
+        recordVoter(ip, token, seq);
+        VoteLog.seq = seq;
+        VoteLog.committedSeq = seq;
+        replayed++;
+    }
+    fclose(f);
 
-    if(bind(sockfd,(struct sockaddr*)&sock,sizeof(sock)) == -1) {
-        printf("Bind() call failed\n");
+    if (ftruncate(VoteLog.fd, good) == -1) {
+        printf("Could not truncate vote log\n");
         exit(1);
     }
+    lseek(VoteLog.fd, good, SEEK_SET);
+    for (int i = 0; i < NumCandidates; i++) {
+        VoteLog.tally[i] = Candidates[i].votes;
+    }
+    printf("Replayed %d votes from %s\n", replayed, VOTELOG);
+    return 0;
+}
 
-    struct sockaddr_in client;
-    memset(&client,0,sizeof(client));
-    socklen_t len = sizeof(client);
+/* writeSnapshot()
+Writes the committed tallies and voters to a temporary file, syncs it, and renames it over the old snapshot.
+Only voters whose records are already on disk are included, so the snapshot matches the log exactly. The
+log is only truncated once the new snapshot is durable, so a crash at any point leaves a recoverable state.
+Called by the log writer, which is the only thread that touches the log file.
+*/
 
-    // Loop for UDP data
-    while (1) {
+int writeSnapshot() {
+    char tmp[50];
+    long seq = VoteLog.committedSeq;
+    sprintf(tmp, "%s.tmp", SNAPFILE);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        printf("Could not write snapshot\n");
+        return -1;
+    }
 
-        voted = 0;
-        printf("Listening...\n");
-        bzero(msgIn, MSGLEN);
-        recvfrom(sockfd, msgIn, MSGLEN, MSG_WAITALL, (struct sockaddr*)&client, &len);
-        printf("Received \"%s\"\n", msgIn);
-
-        // input is one of "vote", "show", "summary" with IP address
-
-        if(strstr(msgIn, "vote") != NULL) {
-            // Check that they haven't voted already
-            clientIP = msgIn + 5;
-            for (int i = 0; i < numVoted; i++) {
-                printf("Checking IP %s against list item %s\n", clientIP, voterList[i]);
-                if (strcmp(voterList[i], clientIP) == 0) {
-                    voted = 1;
-                    break;
+    // Collect the committed voters one stripe at a time
+    int numVoted = 0;
+    int cap = 1024;
+    char *voters = malloc(cap * (20 + TOKENLEN));
+    for (int s = 0; s < NUMSTRIPES; s++) {
+        pthread_mutex_lock(&Voters[s].lock);
+        for (int i = 0; i < Voters[s].capacity; i++) {
+            struct voter *v = &Voters[s].slots[i];
+            if (v->state == VOTED && v->seq <= seq) {
+                if (numVoted == cap) {
+                    cap *= 2;
+                    voters = realloc(voters, cap * (20 + TOKENLEN));
                 }
-            }
-            if (voted) {
-                // Don't send encryption key
-                printf("This client has already voted\n\n");
-                bzero(msgOut, MSGLEN);
-                strcpy(msgOut, "N");
-                sendto(sockfd, msgOut, strlen(msgOut), 0, (const struct sockaddr *) &client, sizeof(client));
-            } else {
-                // Send encryption key
-                strcpy(voterList[numVoted], clientIP);
+                sprintf(voters + numVoted * (20 + TOKENLEN), "%s %s", v->ip, v->token);
                 numVoted++;
-                printf("Sending encryption key back\n\n");
-                sendto(sockfd, key, strlen(key), 0, (const struct sockaddr *) &client, sizeof(client));
-
-                recvfrom(sockfd, msgIn, MSGLEN, MSG_WAITALL, (struct sockaddr*)&client, &len);
-                // Count vote and record IP address of voter
-                printf("Counting vote\n\n");
-                clientVote = atoi(msgIn);
-                clientVote = clientVote / atoi(key);
-                candidates[clientVote - 1][1]++;
-                bzero(msgOut, MSGLEN);
-                strcpy(msgOut, "vote counted");
-                sendto(sockfd, msgOut, strlen(msgOut), 0, (const struct sockaddr *) &client, sizeof(client));
             }
-            
-        } else if (strstr(msgIn, "show") != NULL) {
-            // Send back list of candidates
-            printf("Sending list of candidates back\n\n");
-            sendto(sockfd, list, strlen(list), 0, (const struct sockaddr *) &client, sizeof(client));
-        } else if (strstr(msgIn, "summary") != NULL) {
-
-            // Check that client has already voted
-            clientIP = msgIn + 8;
-            for (int i = 0; i < numVoted; i++) {
-                printf("Checking IP %s against list item %s\n", clientIP, voterList[i]);
-                if (strcmp(voterList[i], clientIP) == 0) {
-                    voted = 1;
+        }
+        pthread_mutex_unlock(&Voters[s].lock);
+    }
+
+    fprintf(f, "snapshot %ld %d %d\n", seq, NumCandidates, numVoted);
+    for (int i = 0; i < NumCandidates; i++) {
+        fprintf(f, "%ld\n", VoteLog.tally[i]);
+    }
+    for (int i = 0; i < numVoted; i++) {
+        fprintf(f, "%s\n", voters + i * (20 + TOKENLEN));
+    }
+    free(voters);
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+
+    if (rename(tmp, SNAPFILE) == -1) {
+        printf("Could not install snapshot\n");
+        return -1;
+    }
+    VoteLog.snapSeq = seq;
+
+    // Records up to snapSeq are now in the snapshot
+    if (ftruncate(VoteLog.fd, 0) == -1) {
+        printf("Could not truncate vote log\n");
+        return -1;
+    }
+    lseek(VoteLog.fd, 0, SEEK_SET);
+    printf("Wrote snapshot at record %ld\n", VoteLog.snapSeq);
+    return 0;
+}
+
+/* queueAck()
+Remembers a client to send "vote counted" (after its request tag) to once the batch being filled is on disk.
+The caller holds VoteLog.lock.
+*/
+
+int queueAck(struct peer *client, char *tag) {
+    struct log_batch *b = &VoteLog.batches[VoteLog.filling];
+    if (b->numAcks == b->ackCap) {
+        b->ackCap = b->ackCap ? b->ackCap * 2 : COMMITBATCH;
+        b->acks = realloc(b->acks, b->ackCap * sizeof(struct vote_ack));
+    }
+    b->acks[b->numAcks].addr = *client;
+    strcpy(b->acks[b->numAcks].tag, tag);
+    b->numAcks++;
+    pthread_cond_signal(&VoteLog.ready);
+    return 0;
+}
+
+/* ackWhenDurable()
+Handles a repeated ballot whose vote has the given record. Returns 0 if the record is on disk and the ballot can
+be acknowledged at once, or 1 if the acknowledgement has been queued for the next commit.
+*/
+
+int ackWhenDurable(struct peer *client, char *tag, long seq) {
+    int queued = 0;
+    pthread_mutex_lock(&VoteLog.lock);
+    if (seq > VoteLog.committedSeq) {
+        queueAck(client, tag);
+        queued = 1;
+    }
+    pthread_mutex_unlock(&VoteLog.lock);
+    return queued;
+}
+
+/* logVote()
+Adds a log record for an accepted vote to the batch being filled and remembers the client to acknowledge
+once it is on disk. Returns the record's sequence number. The caller holds the voter's registry lock, so a
+snapshot never sees the voter without its sequence number.
+*/
+
+long logVote(char *ip, int vote, char *token, struct peer *client, char *tag) {
+    pthread_mutex_lock(&VoteLog.lock);
+    struct log_batch *b = &VoteLog.batches[VoteLog.filling];
+    if (b->bufLen + RECLEN > b->bufCap) {
+        b->bufCap = b->bufCap ? b->bufCap * 2 : COMMITBATCH * RECLEN;
+        b->buf = realloc(b->buf, b->bufCap);
+    }
+    // Release pairs with summaryText(): a summary that sees this seq also sees the caller's tally increment
+    long seq = __atomic_add_fetch(&VoteLog.seq, 1, __ATOMIC_RELEASE);
+    b->bufLen += snprintf(b->buf + b->bufLen, RECLEN, "%ld %s %d %s\n", seq, ip, vote, token);
+    b->counts[vote - 1]++;
+    b->lastSeq = seq;
+    queueAck(client, tag);
+    pthread_mutex_unlock(&VoteLog.lock);
+    return seq;
+}
+
+/* logWriter()
+Log writer thread. Waits for a batch, swaps in the other batch for workers to fill, then writes every record
+with one write and fsync and acknowledges all waiting clients. Takes a snapshot when enough records have
+accumulated in the log.
+*/
+
+void *logWriter(void *arg) {
+    (void) arg;
+    char counted[] = "vote counted";
+    struct iovec ackVecs[BATCH][2];
+    struct mmsghdr ackMsgs[BATCH];
+
+    memset(ackMsgs, 0, sizeof(ackMsgs));
+    for (int i = 0; i < BATCH; i++) {
+        ackVecs[i][1].iov_base = counted;
+        ackVecs[i][1].iov_len = strlen(counted);
+        ackMsgs[i].msg_hdr.msg_iov = ackVecs[i];
+        ackMsgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    while (1) {
+        pthread_mutex_lock(&VoteLog.lock);
+        while (VoteLog.batches[VoteLog.filling].numAcks == 0) {
+            pthread_cond_wait(&VoteLog.ready, &VoteLog.lock);
+        }
+        struct log_batch *b = &VoteLog.batches[VoteLog.filling];
+        VoteLog.filling ^= 1;
+        pthread_mutex_unlock(&VoteLog.lock);
+
+        int off = 0;
+        int n;
+        while (off < b->bufLen) {
+            if ((n = write(VoteLog.fd, b->buf + off, b->bufLen - off)) == -1) {
+                printf("Vote log write failed\n");
+                exit(1);
+            }
+            off += n;
+        }
+        if (b->bufLen > 0 && fdatasync(VoteLog.fd) == -1) {
+            printf("Vote log fsync failed\n");
+            exit(1);
+        }
+
+        pthread_mutex_lock(&VoteLog.lock);
+        if (b->lastSeq > VoteLog.committedSeq) {
+            VoteLog.committedSeq = b->lastSeq;
+        }
+        pthread_mutex_unlock(&VoteLog.lock);
+        for (int i = 0; i < NumCandidates; i++) {
+            VoteLog.tally[i] += b->counts[i];
+            b->counts[i] = 0;
+        }
+
+        // Acknowledge in runs of up to BATCH clients on the same worker socket
+        for (int i = 0; i < b->numAcks; ) {
+            int n = 0;
+            while (i + n < b->numAcks && n < BATCH && b->acks[i + n].addr.sockfd == b->acks[i].addr.sockfd) {
+                ackMsgs[n].msg_hdr.msg_name = &b->acks[i + n].addr.addr;
+                ackMsgs[n].msg_hdr.msg_namelen = b->acks[i + n].addr.len;
+                ackVecs[n][0].iov_base = b->acks[i + n].tag;
+                ackVecs[n][0].iov_len = strlen(b->acks[i + n].tag);
+                n++;
+            }
+            for (int sent = 0; sent < n; ) {
+                int m = sendmmsg(b->acks[i].addr.sockfd, ackMsgs + sent, n - sent, 0);
+                if (m <= 0) {
                     break;
                 }
+                sent += m;
+            }
+            i += n;
+        }
+        LOG("Committed %d votes\n\n", b->numAcks);
+        b->numAcks = 0;
+        b->bufLen = 0;
+
+        if (VoteLog.committedSeq - VoteLog.snapSeq >= SNAPEVERY) {
+            writeSnapshot();
+        }
+    }
+    return NULL;
+}
+
+/* loadCandidates()
+Reads the candidates from a file with one "<votes> <name>" line per candidate in ballot order, where votes is the
+number already counted before this service started. Lines starting with # are comments. Also renders the reply
+to "show", which never changes.
+*/
+
+int loadCandidates(char *path) {
+    char line[NAMELEN + 32];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        printf("Could not open candidate file %s\n", path);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        int nameAt;
+        long votes;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || sscanf(line, "%ld %n", &votes, &nameAt) != 1 || line[nameAt] == '\0') {
+            continue;
+        }
+        if (NumCandidates == MAXCANDIDATES) {
+            printf("Too many candidates in %s\n", path);
+            exit(1);
+        }
+        snprintf(Candidates[NumCandidates].name, NAMELEN, "%s", line + nameAt);
+        Candidates[NumCandidates].votes = votes;
+        NumCandidates++;
+    }
+    fclose(f);
+
+    if (NumCandidates == 0) {
+        printf("No candidates in %s\n", path);
+        exit(1);
+    }
+
+    ShowLen = sprintf(ShowText, "\nThe candidates are:\n");
+    for (int i = 0; i < NumCandidates; i++) {
+        ShowLen += sprintf(ShowText + ShowLen, "%s (ID %d)\n", Candidates[i].name, i + 1);
+    }
+    ShowLen += sprintf(ShowText + ShowLen, "\n");
+    return 0;
+}
+
+/* summaryText()
+Copies the election results into msgOut and returns their length. The rendered results are reused while no
+vote has been logged since, or for up to SUMMARYMS while they already include the asking voter's own vote
+(log record voterSeq). Otherwise the recovered tallies and every worker's shard are added up again.
+*/
+
+int summaryText(char *msgOut, long voterSeq) {
+    int len;
+
+    pthread_rwlock_rdlock(&Summary.lock);
+    long seq = __atomic_load_n(&VoteLog.seq, __ATOMIC_ACQUIRE);
+    if (Summary.len > 0 && (Summary.seq == seq || (voterSeq <= Summary.seq && nowMs() - Summary.builtAt < SUMMARYMS))) {
+        memcpy(msgOut, Summary.text, Summary.len + 1);
+        len = Summary.len;
+        pthread_rwlock_unlock(&Summary.lock);
+        return len;
+    }
+    pthread_rwlock_unlock(&Summary.lock);
+
+    pthread_mutex_lock(&Summary.rebuild);
+    if (Summary.len > 0 && voterSeq <= Summary.seq && nowMs() - Summary.builtAt < SUMMARYMS) {
+        // Another worker has just rebuilt it
+        pthread_rwlock_rdlock(&Summary.lock);
+        memcpy(msgOut, Summary.text, Summary.len + 1);
+        len = Summary.len;
+        pthread_rwlock_unlock(&Summary.lock);
+        pthread_mutex_unlock(&Summary.rebuild);
+        return len;
+    }
+
+    // Every vote up to seq has already been added to its shard
+    seq = __atomic_load_n(&VoteLog.seq, __ATOMIC_ACQUIRE);
+    len = sprintf(msgOut, "\nHere are the results:\n");
+    for (int i = 0; i < NumCandidates; i++) {
+        long total = Candidates[i].votes;
+        for (int j = 0; j < NumWorkers; j++) {
+            total += __atomic_load_n(&Tallies[j].votes[i], __ATOMIC_RELAXED);
+        }
+        len += sprintf(msgOut + len, "%s has %ld votes\n", Candidates[i].name, total);
+    }
+    len += sprintf(msgOut + len, "\n");
+
+    pthread_rwlock_wrlock(&Summary.lock);
+    memcpy(Summary.text, msgOut, len + 1);
+    Summary.len = len;
+    Summary.seq = seq;
+    Summary.builtAt = nowMs();
+    pthread_rwlock_unlock(&Summary.lock);
+    pthread_mutex_unlock(&Summary.rebuild);
+    return len;
+}
+
+/* splitTag()
+Requests may start with a tag of the form "@<id> " which is echoed at the start of the reply, so the client
+can match replies to retransmitted requests. Copies the tag into reply and returns its length (0 if untagged).
+*/
+
+int splitTag(char *msg, char *reply) {
+    if (msg[0] != '@') {
+        return 0;
+    }
+    int len = strcspn(msg, " ");
+    if (msg[len] != ' ' || len > TAGLEN) {
+        return 0;
+    }
+    memcpy(reply, msg, len + 1);
+    return len + 1;
+}
+
+/* handleRequest()
+Serves one "ballot", "vote", "show" or "summary" request, or an encrypted vote completing one of the worker's
+handshakes. Writes the reply into msgOut and returns its length, or 0 if the reply (prefixed with the request's
+tag) is sent by the log writer once the vote is on disk.
+*/
+
+int handleRequest(struct worker *w, char *msgIn, struct peer *client, char *tag, char *msgOut) {
+    long *tally = Tallies[w - Workers].votes;
+    int clientVote;
+    struct voter_table *t;
+    struct voter *voter;
+    struct session *session;
+    char * clientIP;
+    char cIP[20] = {0};
+    char token[TOKENLEN] = {0};
+
+    LOG("Received \"%s\"\n", msgIn);
+
+    // input is one of "ballot", "vote", "show", "summary" with IP address
+
+    if(strncmp(msgIn, "ballot ", 7) == 0) {
+        // One-shot vote carrying the voter's IP, the candidate ID and an idempotency token
+        if (sscanf(msgIn + 7, "%19s %d %23s", cIP, &clientVote, token) != 3 || strcmp(token, "-") == 0) {
+            clientVote = 0;
+        }
+        t = lockVoter(cIP);
+        voter = findVoter(t, cIP);
+        if (voter != NULL && voter->state == VOTED && strcmp(voter->token, token) == 0) {
+            // A retry of a ballot that was already counted - acknowledge it again without counting
+            long seq = voter->seq;
+            pthread_mutex_unlock(&t->lock);
+            LOG("Repeated ballot %s\n\n", token);
+            if (ackWhenDurable(client, tag, seq)) {
+                return 0;
+            }
+            strcpy(msgOut, "vote counted");
+        } else if (voter != NULL && (voter->state == VOTED || voter->expires >= nowMs())) {
+            pthread_mutex_unlock(&t->lock);
+            LOG("This client has already voted\n\n");
+            strcpy(msgOut, "N");
+        } else if (clientVote < 1 || clientVote > NumCandidates) {
+            pthread_mutex_unlock(&t->lock);
+            LOG("Invalid ballot \"%s\"\n\n", msgIn);
+            strcpy(msgOut, "vote not counted");
+        } else {
+            // Count vote and record IP address of voter
+            if (voter == NULL) {
+                voter = addVoter(t, cIP, VOTED);
+            }
+            voter->state = VOTED;
+            strcpy(voter->token, token);
+            __atomic_fetch_add(&tally[clientVote - 1], 1, __ATOMIC_RELAXED);
+            voter->seq = logVote(cIP, clientVote, token, client, tag);
+            pthread_mutex_unlock(&t->lock);
+            LOG("Counting vote\n\n");
+            return 0;
+        }
+
+    } else if(strstr(msgIn, "vote") != NULL) {
+        // Check that they haven't voted already, or aren't partway through voting
+        clientIP = msgIn + 5;
+        sscanf(clientIP, "%19s", cIP);
+        t = lockVoter(cIP);
+        voter = findVoter(t, cIP);
+        if (voter != NULL && (voter->state == VOTED || voter->expires >= nowMs())) {
+            // Don't send encryption key
+            pthread_mutex_unlock(&t->lock);
+            LOG("This client has already voted\n\n");
+            strcpy(msgOut, "N");
+        } else {
+            // Reserve the voter and send a fresh encryption key for this session
+            if (voter == NULL) {
+                voter = addVoter(t, cIP, RESERVED);
             }
+            voter->state = RESERVED;
+            voter->expires = nowMs() + SESSIONMS;
+            pthread_mutex_unlock(&t->lock);
+            session = addSession(&w->sessions, client, cIP, rand_r(&w->seed) % 98 + 2);
+            LOG("Sending encryption key back\n\n");
+            sprintf(msgOut, "%d", session->key);
+        }
+
+    } else if (strstr(msgIn, "show") != NULL) {
+        // Send back list of candidates
+        LOG("Sending list of candidates back\n\n");
+        memcpy(msgOut, ShowText, ShowLen + 1);
+    } else if (strstr(msgIn, "summary") != NULL) {
+
+        // Check that client has already voted
+        clientIP = msgIn + 8;
+        t = lockVoter(clientIP);
+        voter = findVoter(t, clientIP);
+        int voted = voter != NULL && voter->state == VOTED;
+        long votedSeq = voted ? voter->seq : 0;
+        pthread_mutex_unlock(&t->lock);
+
+        if (voted) {
+            // Send back results
+            LOG("Sending voting results back\n\n");
+            return summaryText(msgOut, votedSeq);
+        } else {
+            // Don't send back results
+            LOG("This client hasn't voted yet\n\n");
+            strcpy(msgOut, "N");
+        }
+    } else if ((session = findSession(&w->sessions, client)) != NULL) {
+
+        // An encrypted vote completing a handshake
+        clientVote = atoi(msgIn);
+        clientVote = clientVote / session->key;
+        t = lockVoter(session->ip);
+        voter = findVoter(t, session->ip);
+        if (clientVote >= 1 && clientVote <= NumCandidates && clientVote * session->key == atoi(msgIn)) {
+            // Count vote and record IP address of voter
+            voter->state = VOTED;
+            strcpy(voter->token, "-");
+            __atomic_fetch_add(&tally[clientVote - 1], 1, __ATOMIC_RELAXED);
+            voter->seq = logVote(session->ip, clientVote, "-", client, tag);
+            pthread_mutex_unlock(&t->lock);
+            removeSession(&w->sessions, session);
+            LOG("Counting vote\n\n");
+            return 0;
+        }
+
+        // Release the voter so they can try again
+        voter->expires = 0;
+        pthread_mutex_unlock(&t->lock);
+        removeSession(&w->sessions, session);
+        LOG("Invalid candidate %d\n\n", clientVote);
+        strcpy(msgOut, "vote not counted");
+
+    } else {
+        // Not a command and no handshake is waiting for it
+        LOG("No vote session for this client\n\n");
+        strcpy(msgOut, "vote not counted");
+    }
+
+    return strlen(msgOut);
+}
+
+/* bindUnix()
+Creates a Unix-domain datagram socket at the given path, for interservers on the same host, and returns it.
+*/
+
+int bindUnix(char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s is too long\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        printf("Socket() call failed\n");
+        exit(1);
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        printf("Bind() call failed for %s\n", path);
+        exit(1);
+    }
+    return fd;
+}
+
+/* serveBatch()
+Reads up to BATCH waiting requests from one of a worker's sockets with one recvmmsg(), serves them, and sends
+all the immediate replies with one sendmmsg(). With MSG_WAITFORONE it blocks for the first request.
+*/
+
+int serveBatch(struct worker *w, int sockfd, int flags, char (*msgIn)[MSGLEN], char (*msgOut)[MSGLEN]) {
+    struct peer clients[BATCH];
+    struct iovec inVecs[BATCH], outVecs[BATCH];
+    struct mmsghdr inMsgs[BATCH], outMsgs[BATCH];
+
+    memset(inMsgs, 0, sizeof(inMsgs));
+    memset(outMsgs, 0, sizeof(outMsgs));
+    for (int i = 0; i < BATCH; i++) {
+        inVecs[i].iov_base = msgIn[i];
+        inVecs[i].iov_len = MSGLEN - 1;
+        inMsgs[i].msg_hdr.msg_iov = &inVecs[i];
+        inMsgs[i].msg_hdr.msg_iovlen = 1;
+        inMsgs[i].msg_hdr.msg_name = &clients[i].addr;
+        inMsgs[i].msg_hdr.msg_namelen = sizeof(clients[i].addr);
+        outMsgs[i].msg_hdr.msg_iov = &outVecs[i];
+        outMsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n = recvmmsg(sockfd, inMsgs, BATCH, flags, NULL);
+    if (n <= 0) {
+        return 0;
+    }
+
+    // Serve the batch, collecting the replies that can go out now
+    int numOut = 0;
+    for (int i = 0; i < n; i++) {
+        msgIn[i][inMsgs[i].msg_len] = '\0';
+        clients[i].sockfd = sockfd;
+        clients[i].len = inMsgs[i].msg_hdr.msg_namelen;
+        char tag[TAGLEN + 2] = {0};
+        int tagLen = splitTag(msgIn[i], tag);
+        memcpy(msgOut[numOut], tag, tagLen);
+        int replyLen = handleRequest(w, msgIn[i] + tagLen, &clients[i], tag, msgOut[numOut] + tagLen);
+        if (replyLen > 0) {
+            outVecs[numOut].iov_base = msgOut[numOut];
+            outVecs[numOut].iov_len = tagLen + replyLen;
+            outMsgs[numOut].msg_hdr.msg_name = &clients[i].addr;
+            outMsgs[numOut].msg_hdr.msg_namelen = clients[i].len;
+            numOut++;
+        }
+    }
+
+    for (int sent = 0; sent < numOut; ) {
+        int m = sendmmsg(sockfd, outMsgs + sent, numOut - sent, 0);
+        if (m <= 0) {
+            break;
+        }
+        sent += m;
+    }
+    return n;
+}
+
+/* worker()
+Worker thread. Serves batches of requests from its UDP socket and, for the worker that has it, the Unix-domain
+socket.
+*/
+
+void *worker(void *arg) {
+    struct worker *w = arg;
+
+    // One buffer per request in a batch
+    char (*msgIn)[MSGLEN] = malloc(BATCH * MSGLEN);
+    char (*msgOut)[MSGLEN] = malloc(BATCH * MSGLEN);
+    struct pollfd fds[2] = {{ .fd = w->sockfd, .events = POLLIN }, { .fd = w->unixfd, .events = POLLIN }};
 
-            if (voted) {
-                // Send back results
-                printf("Sending voting results back\n\n");
-                sprintf(summary, "\nHere are the results:\nBen Smith has %d votes\nJessica Narwhal has %d votes\nKimberly Johnson has %d votes\nTristan Roberts has %d votes\n\n", candidates[0][1], candidates[1][1], candidates[2][1], candidates[3][1]);
-                sendto(sockfd, summary, strlen(summary), 0, (const struct sockaddr *) &client, sizeof(client));
-            } else {
-                // Don't send back results
-                printf("This client hasn't voted yet\n\n");
-                bzero(msgOut, MSGLEN);
-                strcpy(msgOut, "N");
-                sendto(sockfd, msgOut, strlen(msgOut), 0, (const struct sockaddr *) &client, sizeof(client));
+    if (w->cpu != -1) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(w->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    // Loop for data
+    while (1) {
+        if (w->unixfd == -1) {
+            // Block for the first request, then take whatever else is already queued
+            serveBatch(w, w->sockfd, MSG_WAITFORONE, msgIn, msgOut);
+            continue;
+        }
+        if (poll(fds, 2, -1) <= 0) {
+            continue;
+        }
+        for (int f = 0; f < 2; f++) {
+            if (fds[f].revents & POLLIN) {
+                serveBatch(w, fds[f].fd, MSG_DONTWAIT, msgIn, msgOut);
             }
         }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+
+    int opt;
+    int port = PORTNUM;
+    char *candidateFile = CANDIDATEFILE;
+    char *unixPath = NULL;
+    int pin = 0;
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    NumWorkers = cpus;
+    while ((opt = getopt(argc, argv, "p:u:w:c:av")) != -1) {
+        if (opt == 'p') {
+            port = atoi(optarg);
+        } else if (opt == 'u') {
+            unixPath = optarg;
+        } else if (opt == 'w') {
+            NumWorkers = atoi(optarg);
+        } else if (opt == 'c') {
+            candidateFile = optarg;
+        } else if (opt == 'a') {
+            pin = 1;
+        } else if (opt == 'v') {
+            Verbose = 1;
+        } else {
+            printf("Usage: %s [-p port] [-u socket path] [-w workers] [-c candidates] [-a] [-v]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (NumWorkers < 1) {
+        NumWorkers = 1;
+    } else if (NumWorkers > MAXWORKERS) {
+        NumWorkers = MAXWORKERS;
+    }
+
+    loadCandidates(candidateFile);
+
+    for (int s = 0; s < NUMSTRIPES; s++) {
+        pthread_mutex_init(&Voters[s].lock, NULL);
+    }
+    pthread_mutex_init(&VoteLog.lock, NULL);
+    pthread_cond_init(&VoteLog.ready, NULL);
+    pthread_rwlock_init(&Summary.lock, NULL);
+    pthread_mutex_init(&Summary.rebuild, NULL);
+
+    // Recover the election from disk
+    loadSnapshot();
+    replayLog();
+
+    // initialize and bind one socket per worker
+    struct sockaddr_in sock;
+    memset(&sock,0,sizeof(sock));
+    sock.sin_family = AF_INET;
+    sock.sin_port = htons(port);
+    sock.sin_addr.s_addr = INADDR_ANY;
+    int on = 1;
+
+    for (int i = 0; i < NumWorkers; i++) {
+        // Create socket for UDP data
+        Workers[i].sockfd = socket(AF_INET,SOCK_DGRAM,IPPROTO_UDP);
+        if (Workers[i].sockfd == -1) {
+            printf("Socket() call failed\n");
+            exit(1);
+        }
+        if (setsockopt(Workers[i].sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+            printf("Setsockopt failed\n");
+            exit(1);
+        }
+        if(bind(Workers[i].sockfd,(struct sockaddr*)&sock,sizeof(sock)) == -1) {
+            printf("Bind() call failed\n");
+            exit(1);
+        }
+        Workers[i].seed = time(NULL) ^ getpid() ^ (i << 16);
+        Workers[i].unixfd = -1;
+        Workers[i].cpu = pin ? i % cpus : -1;
+    }
 
+    // The Unix-domain socket is served by the first worker, so a handshake over it stays with one worker
+    if (unixPath != NULL) {
+        Workers[0].unixfd = bindUnix(unixPath);
     }
 
-    close(sockfd);
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, logWriter, NULL) != 0) {
+        printf("Could not start log writer\n");
+        exit(1);
+    }
+    for (int i = 0; i < NumWorkers; i++) {
+        if (pthread_create(&Workers[i].thread, NULL, worker, &Workers[i]) != 0) {
+            printf("Could not start worker %d\n", i);
+            exit(1);
+        }
+    }
+    printf("Serving votes with %d workers\n", NumWorkers);
+
+    for (int i = 0; i < NumWorkers; i++) {
+        pthread_join(Workers[i].thread, NULL);
+    }
     return 0;
-}
\ No newline at end of file
+}